@@ -0,0 +1,82 @@
+//
+// count -- sql_count() against running count_sql on every redraw
+//
+// the table used to run select count(rowid) once a second per window, the
+// cached count is read in microseconds and kept exact from the writer's
+// inserts and deletes while rows are being ingested
+//
+//	bench/count [rows [ingest]]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include "sql.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+static double ms_since(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now()-t0).count();
+}
+static int count_now(const char *where)		//as count_sql did
+{
+	char sql[256];
+	snprintf(sql, sizeof(sql), "select count(rowid) from Alarms%s%s",
+				*where ? " where " : "", where);
+	sql_row(sql);
+	return atoi(sql);
+}
+static int count_cached(const char *where)	//waits for the first count
+{
+	int n;
+	while ( !sql_count("Alarms", where, &n) )
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return n;
+}
+int main(int argc, char *argv[])
+{
+	int rows = argc>1 ? atoi(argv[1]) : 2000000;
+	int ingest = argc>2 ? atoi(argv[2]) : 100000;
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	if ( !sql_open("bench.db") ) return 1;
+	sql_exec("create table Alarms(nodename,severity,alarm,cleared)", NULL, NULL);
+	int id = sql_ingest_prepare("insert into Alarms values(?,?,?,?)");
+	char node[32];
+	for ( int i=0; i<rows; i++ ) {
+		snprintf(node, sizeof(node), "node%d", i%500);
+		sql_ingest(id, "ssss", node, "major", "LOS", i%3 ? "yes" : "");
+	}
+	sql_commit();
+
+	const char *wheres[] = { "", "cleared=''" };
+	for ( const char *where : wheres ) {
+		printf("where \"%s\"\n", where);
+		auto t0 = std::chrono::steady_clock::now();
+		int n = count_now(where);
+		printf("  count(rowid)     %9.3f ms  %d rows\n", ms_since(t0), n);
+		t0 = std::chrono::steady_clock::now();
+		n = count_cached(where);
+		printf("  first sql_count  %9.3f ms  %d rows\n", ms_since(t0), n);
+		int exact = 0, times = 100000;
+		t0 = std::chrono::steady_clock::now();
+		for ( int i=0; i<times; i++ ) exact += sql_count("Alarms", where, &n);
+		printf("  sql_count        %9.3f us  %d of %d exact\n",
+				ms_since(t0)*1000/times, exact, times);
+
+		t0 = std::chrono::steady_clock::now();
+		for ( int i=0; i<ingest; i++ ) {
+			sql_ingest(id, "ssss", "node0", "minor", "LOF", i%3 ? "yes" : "");
+			if ( i%1000==0 ) sql_count("Alarms", where, &n);
+		}
+		sql_commit();
+		n = count_cached(where);
+		printf("  ingest, exact    %9.3f ms  %d rows, count(rowid) %d\n",
+				ms_since(t0), n, count_now(where));
+	}
+	sql_close();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	return 0;
+}
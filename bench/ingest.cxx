@@ -0,0 +1,62 @@
+//
+// ingest -- the same rows through sql_queue() and through sql_ingest()
+//
+// sql_queue() formats each row into SQL text that the writer parses, a
+// template from sql_ingest_prepare() is parsed once and the writer binds
+// the values, the CPU time of the process covers both sides
+//
+//	bench/ingest [rows]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <chrono>
+#include "sql.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+static void report(const char *name, int rows, double secs, double cpu)
+{
+	printf("%-12s %d rows %6.2f s %9.0f rows/s, cpu %6.2f s %6.2f us/row\n",
+			name, rows, secs, rows/secs, cpu, cpu*1e6/rows);
+}
+int main(int argc, char *argv[])
+{
+	int rows = argc>1 ? atoi(argv[1]) : 500000;
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	if ( !sql_open("bench.db") ) return 1;
+	sql_exec("create table Q(nodename,severity,port,loss,alarm)", NULL, NULL);
+	sql_exec("create table I(nodename,severity,port,loss,alarm)", NULL, NULL);
+
+	clock_t c0 = clock();
+	auto t0 = std::chrono::steady_clock::now();
+	for ( int i=0; i<rows; i++ )
+		sql_queue("insert into Q values('node%d','major',%d,%g,'LOS on port %d')",
+					i%500, i%48, i*0.25, i%48);
+	sql_commit();
+	double secs = std::chrono::duration<double>(
+					std::chrono::steady_clock::now()-t0).count();
+	report("sql_queue", rows, secs, double(clock()-c0)/CLOCKS_PER_SEC);
+
+	char node[32], alarm[64];
+	int id = sql_ingest_prepare("insert into I values(?,?,?,?,?)");
+	if ( id<0 ) {
+		printf("%s\n", sql_errmsg());
+		return 1;
+	}
+	c0 = clock();
+	t0 = std::chrono::steady_clock::now();
+	for ( int i=0; i<rows; i++ ) {
+		snprintf(node, sizeof(node), "node%d", i%500);
+		snprintf(alarm, sizeof(alarm), "LOS on port %d", i%48);
+		sql_ingest(id, "ssifs", node, "major", i%48, i*0.25, alarm);
+	}
+	sql_commit();
+	secs = std::chrono::duration<double>(
+					std::chrono::steady_clock::now()-t0).count();
+	report("sql_ingest", rows, secs, double(clock()-c0)/CLOCKS_PER_SEC);
+
+	sql_close();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	return 0;
+}
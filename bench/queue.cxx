@@ -0,0 +1,87 @@
+//
+// queue -- sql_queue() enqueue latency while the writer commits
+//
+// producer threads queue inserts at a steady rate while another thread
+// calls sql_commit() in a loop, each enqueue is timed and counted as
+// during a commit or not, the two sets of percentiles should be alike
+//
+//	bench/queue [producers [rows [rate]]], rate per producer, 0 for flat out
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "sql.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+static std::atomic<bool> committing(false), stop(false);
+static void percentiles(const char *name, std::vector<double> &us)
+{
+	if ( us.empty() ) {
+		printf("%-16s no samples\n", name);
+		return;
+	}
+	std::sort(us.begin(), us.end());
+	size_t n = us.size();
+	printf("%-16s %9zu  p50 %7.2f  p99 %7.2f  p99.9 %8.2f  max %9.1f us\n",
+			name, n, us[n/2], us[n*99/100], us[n*999/1000], us[n-1]);
+}
+int main(int argc, char *argv[])
+{
+	int producers = argc>1 ? atoi(argv[1]) : 4;
+	int rows = argc>2 ? atoi(argv[2]) : 100000;
+	int rate = argc>3 ? atoi(argv[3]) : 10000;
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	if ( !sql_open("bench.db") ) return 1;
+	sql_exec("create table Alarms(nodename,severity,alarm,cleared)", NULL, NULL);
+
+	std::vector<std::vector<double> > idle(producers), busy(producers);
+	std::vector<std::thread> threads;
+	auto t0 = std::chrono::steady_clock::now();
+	for ( int p=0; p<producers; p++ ) threads.emplace_back([=, &idle, &busy] {
+		idle[p].reserve(rows);
+		busy[p].reserve(rows);
+		auto start = std::chrono::steady_clock::now();
+		for ( int i=0; i<rows; i++ ) {
+			if ( rate>0 && i%100==0 )
+				std::this_thread::sleep_until(start+
+							std::chrono::microseconds(i*1000000LL/rate));
+			int during = committing;
+			auto a = std::chrono::steady_clock::now();
+			sql_queue("insert into Alarms values('node%d','major',"
+					  "'LOS on port %d','')", p, i);
+			auto b = std::chrono::steady_clock::now();
+			double us = std::chrono::duration<double, std::micro>(b-a).count();
+			(during || committing ? busy[p] : idle[p]).push_back(us);
+		}
+	});
+	std::thread committer([] {
+		while ( !stop ) {
+			committing = true;
+			sql_commit();
+			committing = false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	});
+	for ( auto &t : threads ) t.join();
+	stop = true;
+	committer.join();
+	sql_commit();
+	double secs = std::chrono::duration<double>(
+					std::chrono::steady_clock::now()-t0).count();
+
+	std::vector<double> a, b;
+	for ( auto &v : idle ) a.insert(a.end(), v.begin(), v.end());
+	for ( auto &v : busy ) b.insert(b.end(), v.begin(), v.end());
+	printf("%d producers, %d rows in %.2f s, %.0f rows/s\n",
+			producers, producers*rows, secs, producers*rows/secs);
+	percentiles("no commit", a);
+	percentiles("during commit", b);
+	sql_close();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	return 0;
+}
@@ -0,0 +1,78 @@
+//
+// rows -- heap allocations of a window refresh, row_store against rows of
+// strings
+//
+// a refresh used to insert a new Row, a vector of strings, at the front of
+// _rowdata for every row read, row_store keeps one text buffer and offset
+// tables that are reused once the first refresh has sized them
+//
+//	bench/rows [rows [cols [refreshes]]]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include "sqlTable.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+static std::atomic<long> allocs(0);
+void *operator new(size_t n)
+{
+	allocs++;
+	void *p = malloc(n ? n : 1);
+	if ( p==NULL ) throw std::bad_alloc();
+	return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+int main(int argc, char *argv[])
+{
+	int rows = argc>1 ? atoi(argv[1]) : 120;		//a 4K monitor
+	int cols = argc>2 ? atoi(argv[2]) : 20;
+	int refreshes = argc>3 ? atoi(argv[3]) : 1000;
+
+	std::vector<std::string> text(rows*cols);		//as sqlite3 hands them
+	std::vector<const char *> cells(rows*cols);
+	for ( int i=0; i<rows*cols; i++ ) {
+		char cell[64];
+		snprintf(cell, sizeof(cell), i%cols==0 ? "node%d" :
+					"LOS on port %d of shelf 1", i/cols);
+		text[i] = cell;
+		cells[i] = text[i].c_str();
+	}
+	printf("%d rows of %d cells, %d refreshes\n", rows, cols, refreshes);
+
+	std::vector<Row> rowdata;
+	long a0 = allocs;
+	auto t0 = std::chrono::steady_clock::now();
+	for ( int k=0; k<refreshes; k++ ) {
+		rowdata.clear();
+		for ( int r=0; r<rows; r++ ) {
+			Row row;
+			for ( int c=0; c<cols; c++ ) row.push_back(cells[r*cols+c]);
+			rowdata.insert(rowdata.begin(), row);
+		}
+	}
+	double us = std::chrono::duration<double, std::micro>(
+				std::chrono::steady_clock::now()-t0).count();
+	printf("%-10s %10.1f allocations %9.1f us per refresh\n", "Row",
+			double(allocs-a0)/refreshes, us/refreshes);
+
+	row_store store;
+	store.clear();
+	for ( int r=0; r<rows; r++ ) store.add(&cells[r*cols], cols);
+	a0 = allocs;
+	t0 = std::chrono::steady_clock::now();
+	for ( int k=0; k<refreshes; k++ ) {
+		store.clear();
+		for ( int r=rows-1; r>=0; r-- ) store.add(&cells[r*cols], cols);
+	}
+	us = std::chrono::duration<double, std::micro>(
+				std::chrono::steady_clock::now()-t0).count();
+	printf("%-10s %10.1f allocations %9.1f us per refresh\n", "row_store",
+			double(allocs-a0)/refreshes, us/refreshes);
+	return 0;
+}
@@ -0,0 +1,92 @@
+//
+// seek -- a page of rows read by offset and by seeking from the key before it
+//
+// the page query is built by key_query as sqlTable builds it for
+// "select * from Alarms order by ts", at offsets across the table, the
+// offset read walks every row skipped, the seek stays flat
+//
+//	bench/seek [rows [page]]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "sql.h"
+#include "sqlTable.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+static int count_cb(void *data, int n, char **argv, char **cols)
+{
+	(*(int *)data)++;
+	return 0;
+}
+static double read_ms(const std::string &sql, const Row &key, int times,
+						int *rows)
+{
+	std::vector<const char *> values;
+	for ( auto &v : key ) values.push_back(v.c_str());
+	auto t0 = std::chrono::steady_clock::now();
+	for ( int i=0; i<times; i++ ) {
+		*rows = 0;
+		sql_select_bound(sql.c_str(), values.size(), values.data(),
+							count_cb, rows);
+	}
+	return std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now()-t0).count()/times;
+}
+int main(int argc, char *argv[])
+{
+	int rows = argc>1 ? atoi(argv[1]) : 1000000;
+	int page = argc>2 ? atoi(argv[2]) : 50;
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	if ( !sql_open("bench.db") ) return 1;
+	sql_exec("create table Alarms(nodename,severity,ts,alarm,cleared)",
+				NULL, NULL);
+	int id = sql_ingest_prepare("insert into Alarms values(?,?,?,?,?)");
+	char node[32];
+	for ( int i=0; i<rows; i++ ) {
+		snprintf(node, sizeof(node), "node%d", i%500);
+		sql_ingest(id, "ssiss", node, "major", i, "LOS", "");
+	}
+	sql_commit();
+	sql_exec("create index Alarms_ts on Alarms(ts)", NULL, NULL);
+
+	key_query query;						//as keyset_parse() splits it
+	query.keys = "," + key_query::key_expr("ts") + ",rowid";
+	query.select = "select *" + query.keys;
+	query.table = " from Alarms";
+	query.where = "";
+	query.cols = { "ts", "rowid" };
+	query.desc = { false, false };
+	query.star = true;
+
+	printf("%d rows, pages of %d, ms per page\n", rows, page);
+	printf("%10s %10s %10s\n", "row", "offset", "seek");
+	const double at[] = { 0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.999 };
+	for ( double f : at ) {
+		int offset = int(rows*f);
+		int n1, n2;
+		double off = read_ms(query.sql(NULL, false, page, offset), Row(), 5, &n1);
+
+		Row key;						//the last row of the page before
+		if ( offset>0 ) {
+			char sql[256];
+			snprintf(sql, sizeof(sql), "select %s,rowid from Alarms "
+						"order by ts,rowid limit 1 offset %d",
+						key_query::key_expr("ts").c_str(), offset-1);
+			sql_row(sql);
+			char *sp = strchr(sql, ' ');
+			if ( sp==NULL ) return 1;
+			key.push_back(std::string(sql, sp-sql));
+			key.push_back(sp+1);
+		}
+		double seek = read_ms(query.sql(offset>0 ? &key : NULL, false, page, 0),
+								key, 50, &n2);
+		printf("%10d %10.3f %10.3f%s\n", offset, off, seek,
+				n1==n2 ? "" : "  row counts differ");
+	}
+	sql_close();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	return 0;
+}
@@ -0,0 +1,89 @@
+//
+// widths -- measuring the cells of a window refresh, with and without the
+// text_width() memo
+//
+// a refresh used to call fl_font and fl_measure on every cell it read, the
+// table now looks the text up in textWidths and measures only what it has
+// not seen, alarms repeat their node names and severities. needs a display
+//
+//	bench/widths [rows [cols [refreshes]]]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <FL/Fl_Window.H>
+#include <FL/fl_draw.H>
+#include "sql.h"
+#include "sqlTable.h"
+
+void log_print(const char *name, const char *msg, int len) {}
+
+class bench_table : public sqlTable {
+public:
+	bench_table() : sqlTable(0, 0, 1024, 640, "Alarms") {}
+	void widths(const row_store &rows)
+	{
+		for ( size_t r=0; r<rows.size(); r++ ) col_widths(rows, r);
+	}
+};
+int main(int argc, char *argv[])
+{
+	int rows = argc>1 ? atoi(argv[1]) : 120;
+	int cols = argc>2 ? atoi(argv[2]) : 20;
+	int refreshes = argc>3 ? atoi(argv[3]) : 100;
+	Fl_Window win(200, 100, "widths");	//for the display's fonts
+	win.end();
+	win.show();
+	Fl::check();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	if ( !sql_open("bench.db") ) return 1;
+	sql_exec("create table Alarms(nodename,severity,alarm,cleared)", NULL, NULL);
+
+	const char *severity[] = { "critical", "major", "minor", "warning" };
+	std::vector<std::string> text(rows*cols);
+	std::vector<const char *> cells(rows*cols);
+	for ( int i=0; i<rows*cols; i++ ) {
+		char cell[64];
+		int r = i/cols, c = i%cols;
+		if ( c==0 ) snprintf(cell, sizeof(cell), "node%d", r%40);
+		else if ( c==1 ) snprintf(cell, sizeof(cell), "%s", severity[r%4]);
+		else snprintf(cell, sizeof(cell), "LOS on port %d", (r*cols+c)%48);
+		text[i] = cell;
+		cells[i] = text[i].c_str();
+	}
+	row_store store;
+	for ( int r=0; r<rows; r++ ) store.add(&cells[r*cols], cols);
+	printf("%d rows of %d cells, %d refreshes\n", rows, cols, refreshes);
+
+	bench_table *table = new bench_table;
+	table->cols(cols);
+	std::vector<int> width(cols);
+	for ( int c=0; c<cols; c++ ) width[c] = table->col_width(c);
+	auto t0 = std::chrono::steady_clock::now();
+	for ( int k=0; k<refreshes; k++ ) {
+		for ( size_t r=0; r<store.size(); r++ )
+			for ( int c=0; c<cols; c++ ) {
+				int w=0, h=0;
+				fl_font(ROW_FONTFACE, ROW_FONTSIZE);
+				fl_measure(store.cell(r, c), w, h, 0);
+				if ( w+24>width[c] ) width[c] = std::min(w+24, 600);
+			}
+	}
+	double us = std::chrono::duration<double, std::micro>(
+				std::chrono::steady_clock::now()-t0).count();
+	printf("%-12s %9.1f us per refresh\n", "fl_measure", us/refreshes);
+
+	t0 = std::chrono::steady_clock::now();
+	for ( int k=0; k<refreshes; k++ ) table->widths(store);
+	us = std::chrono::duration<double, std::micro>(
+				std::chrono::steady_clock::now()-t0).count();
+	printf("%-12s %9.1f us per refresh\n", "text_width", us/refreshes);
+	for ( int c=0; c<cols; c++ )
+		if ( table->col_width(c)!=width[c] )
+			printf("column %d is %d wide, measured %d\n", c,
+					table->col_width(c), width[c]);
+	delete table;
+	sql_close();
+	remove("bench.db"); remove("bench.db-wal"); remove("bench.db-shm");
+	return 0;
+}
@@ -0,0 +1,86 @@
+//
+// fltb.js -- reference decoder for the binary result format of flTable
+//
+// Request a query with BIN= instead of SQL= and read the reply as an
+// ArrayBuffer, e.g.
+//
+//	var xhr = new XMLHttpRequest();
+//	xhr.open("POST", "http://127.0.0.1:8080", true);
+//	xhr.responseType = "arraybuffer";
+//	xhr.onload = function() {
+//		var t = fltbDecode(xhr.response);
+//		// t.names = ["nodename", "pm_data"], t.columns[1][0] = 42
+//	};
+//	xhr.send("BIN=select nodename,pm_data from Interfaces");
+//
+// The result is column major: columns[i] is an array with one value per
+// row, null for SQL NULL, Number for integer and real, String for text
+// and Uint8Array for blob. Integers beyond 2^53 are returned as BigInt.
+// The layout is described above sql_stream_binary() in src/sql.cxx.
+//
+function fltbDecode(buffer)
+{
+	var view = new DataView(buffer);
+	var utf8 = new TextDecoder("utf-8");
+	var pos = 0;
+	function u8()  { return view.getUint8(pos++); }
+	function u16() { var v = view.getUint16(pos, true); pos += 2; return v; }
+	function u32() { var v = view.getUint32(pos, true); pos += 4; return v; }
+	function bytes(n) { var b = new Uint8Array(buffer, pos, n); pos += n; return b; }
+	function varint() {
+		var v = 0n, shift = 0n, b;
+		do {
+			b = u8();
+			v |= BigInt(b&0x7f)<<shift;
+			shift += 7n;
+		} while ( b&0x80 );
+		return v;
+	}
+	function string() { return utf8.decode(bytes(Number(varint()))); }
+
+	if ( utf8.decode(bytes(4))!=="FLTB" ) throw new Error("not a FLTB reply");
+	var version = u16();
+	if ( version!==1 ) throw new Error("FLTB version " + version);
+	var ncols = u16();
+	var names = [], columns = [];
+	for ( var i=0; i<ncols; i++ ) {
+		names.push(utf8.decode(bytes(u16())));
+		columns.push([]);
+	}
+
+	var rows;
+	while ( (rows=u32())!==0 ) {
+		if ( rows===0xffffffff ) throw new Error(utf8.decode(bytes(u16())));
+		for ( var c=0; c<ncols; c++ ) {
+			var type = u8();
+			var nulls = bytes((rows+7)>>3);
+			var col = columns[c];
+			var dict = [], prev = 0n;
+			if ( type===5 ) {
+				for ( var n=Number(varint()); n>0; n-- ) dict.push(string());
+			}
+			for ( var r=0; r<rows; r++ ) {
+				if ( type===0 || (nulls[r>>3]>>(r&7))&1 ) {
+					col.push(null);
+					continue;
+				}
+				var v = null, z;
+				switch ( type ) {
+				case 1:
+					z = varint();
+					prev = BigInt.asIntN(64, prev + ((z>>1n) ^ -(z&1n)));
+					v = prev;
+					if ( v>=Number.MIN_SAFE_INTEGER && v<=Number.MAX_SAFE_INTEGER )
+						v = Number(v);
+					break;
+				case 2: v = view.getFloat64(pos, true); pos += 8; break;
+				case 3: v = string(); break;
+				case 4: v = bytes(Number(varint())).slice(); break;
+				case 5: v = dict[Number(varint())]; break;
+				}
+				col.push(v);
+			}
+		}
+	}
+	return { names: names, columns: columns };
+}
@@ -38,6 +38,9 @@ https://github.com/zoudaokou/flTable\n";
 	#include <unistd.h>
 	#define closesocket close
 #endif
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif
 #include <stdio.h>
 #include "sql.h"
 #include "sqlTable.h"
@@ -58,12 +61,15 @@ void httpd_exit();
 #include <FL/Fl_Box.H>
 #include <FL/Fl_Tabs.H>
 #include <FL/Fl_Input.H>
+#include <FL/Fl_Browser.H>
+#include <FL/Fl_Progress.H>
 #include <FL/Fl_Sys_Menu_Bar.H>
 #include <FL/Fl_Double_Window.H>
 #include <FL/Fl_Native_File_Chooser.H>
 #include "Fl_Browser_Input.h"
 Fl_Sys_Menu_Bar *pMenu;
 Fl_Browser_Input *pCmd;
+Fl_Progress *pProgress;			//background jobs, shown over the SQL bar
 Fl_Window *pTableWin;
 sqlTable *pTable;
 
@@ -92,6 +98,11 @@ void cmd_callback(Fl_Widget *w) {
 	if ( strncmp(buf, "select", 6)==0 ) {
 		pTable->select(buf);
 	}
+	else if ( strncmp(buf, "style ", 6)==0 ) {
+		if ( !pTable->style(buf+6) )
+			fl_alert("style <column|*> <color> when <column> <op> <value>"
+					 " [and ...]\nstyle clear\nstyle default");
+	}
 	else {
 		if( sql_exec(buf, NULL, NULL) )
 			pTable->redraw();
@@ -101,9 +112,7 @@ void cmd_callback(Fl_Widget *w) {
 }
 void second_timer( void *pv )
 {
-	if ( pTable!=NULL ) {
-		pTable->data_changed(true);
-		pTable->redraw();
+	if ( pTable!=NULL ) {				//refreshed by the table on changes
 		if ( Fl::focus()!=pCmd ) {
 			pCmd->value( pTable->select() );
 			Fl::awake(pCmd);
@@ -115,9 +124,7 @@ void table_change_callback(void *data, int type,
 							const char *db_name,
 							const char *tbl_name, sqlite3_int64 rowid)
 {
-	if ( !pTable->data_changed() )
-		if ( strcmp(pTable->label(), tbl_name)==0 )
-			pTable->data_changed(true);
+	pTable->row_changed(type, tbl_name, rowid);
 }
 void table_callback(Fl_Widget *w, void *data)
 {
@@ -128,9 +135,10 @@ void table_callback(Fl_Widget *w, void *data)
 	pMenu->redraw();
 }
 
+static const char *db_profile = NULL;	//storage profile from command line
 void table_open(const char *fn)
 {
-	if ( sql_open(fn) ) {
+	if ( sql_open(fn, db_profile) ) {
 		char *tbl_names;
 		sql_table("select name from sqlite_master where type='table'",
 							&tbl_names);
@@ -154,15 +162,129 @@ void dbopen_callback(Fl_Widget *w, void *data)
 								Fl_Native_File_Chooser::BROWSE_FILE);
 	if ( fn!=NULL ) table_open(fn);
 }
-void dbsave_callback(Fl_Widget *w, void *data)
+static int save_cancelled = false;
+void save_timer(void *pv)
 {
-	const char *fn = file_chooser("Save database as", "Database\t*.db" );
-	if ( fn!=NULL ) sql_save(fn);
+	int done, total;
+	int state = sql_save_progress(&done, &total);
+	if ( state==1 ) {
+		pProgress->maximum(total>0 ? total : 1);
+		pProgress->value(done);
+		Fl::repeat_timeout(0.2, save_timer);
+		return;
+	}
+	pProgress->hide();
+	if ( state==-1 && !save_cancelled )
+		fl_alert("%s", sql_errmsg());
+}
+void dbsave_callback(Fl_Widget *w, void *data)	//data!=NULL for compacted
+{
+	const char *fn = file_chooser(data==NULL ? "Save database as" :
+						"Save compacted snapshot as", "Database\t*.db" );
+	if ( fn==NULL ) return;
+	if ( sql_save(fn, data!=NULL) ) {
+		save_cancelled = false;
+		pProgress->label(data==NULL ? "saving" : "compacting");
+		pProgress->minimum(0);
+		pProgress->value(0);
+		pProgress->show();
+		Fl::add_timeout(0.2, save_timer);
+	}
+	else
+		fl_alert("%s", sql_errmsg());
+}
+void savecancel_callback(Fl_Widget *w, void *data)
+{
+	save_cancelled = true;
+	sql_save_cancel();
+}
+static int export_cancelled = false;
+void export_timer(void *pv)
+{
+	int rows;
+	int state = sql_export_progress(&rows);
+	if ( state==1 ) {
+		pProgress->maximum(pTable->rows()>0 ? pTable->rows() : 1);
+		pProgress->value(rows);
+		Fl::repeat_timeout(0.2, export_timer);
+		return;
+	}
+	pProgress->hide();
+	if ( state==-1 && !export_cancelled ) fl_alert("%s", sql_errmsg());
 }
 void csvsave_callback(Fl_Widget *w, void *data)
 {
-	const char *fn = file_chooser("Save table to", "Spreadsheet\t*.csv" );
-	if ( fn!=NULL )	pTable->save(fn);
+	const char *fn = file_chooser("Save table to",
+								"Spreadsheet\t*.csv\nArrow IPC\t*.arrow" );
+	if ( fn==NULL ) return;
+	if ( pTable->save(fn) ) {
+		export_cancelled = false;
+		pProgress->label("exporting");
+		pProgress->minimum(0);
+		pProgress->value(0);
+		pProgress->show();
+		Fl::add_timeout(0.2, export_timer);
+	}
+	else
+		fl_alert("%s", sql_errmsg());
+}
+void exportcancel_callback(Fl_Widget *w, void *data)
+{
+	export_cancelled = true;
+	sql_export_cancel();
+}
+static void *import_handle = NULL;		//the import started from the menu
+void import_timer(void *pv)
+{
+	static char label[64];
+	sqlite3_int64 rows;
+	double secs;
+	int percent;
+	int state = sql_import_progress(import_handle, &rows, &secs, &percent);
+	if ( state==1 ) {
+		sprintf(label, "%.0f rows/s", secs>0 ? rows/secs : 0);
+		pProgress->label(label);
+		pProgress->value(percent);
+		Fl::repeat_timeout(0.2, import_timer, pv);
+		return;
+	}
+	import_handle = NULL;
+	pProgress->hide();
+	const char *table = (const char *)pv;
+	if ( state==0 ) {
+		char item[256];
+		snprintf(item, 256, "Table/%s", table);
+		if ( pMenu->find_item(item)==NULL )
+			pMenu->add(item, 0, table_callback, NULL);
+		pTable->redraw();
+		fl_message("%lld rows imported into %s in %.1f seconds, %.0f rows/s",
+					(long long)rows, table, secs, secs>0 ? rows/secs : 0);
+	}
+	else
+		fl_alert("%s", sql_errmsg());
+}
+void import_callback(Fl_Widget *w, void *data)
+{
+	static char table[256];
+	const char *fn = file_chooser("Import rows from",
+							"Spreadsheet\t*.{csv,tsv,txt}",
+							Fl_Native_File_Chooser::BROWSE_FILE);
+	if ( fn==NULL ) return;
+	std::string file = fn;
+	const char *name = fl_input("Import into table", pTable->label());
+	if ( name==NULL || *name==0 ) return;
+	strncpy(table, name, 255);
+	if ( import_handle==NULL &&
+		 (import_handle=sql_import(file.c_str(), table))!=NULL ) {
+		pProgress->label("importing");
+		pProgress->minimum(0);
+		pProgress->maximum(100);
+		pProgress->value(0);
+		pProgress->show();
+		Fl::add_timeout(0.2, import_timer, table);
+	}
+	else
+		fl_alert("A table import is already running");
 }
 void rowcopy_callback(Fl_Widget *w, void *data)
 {
@@ -172,6 +294,51 @@ void rowpaste_callback(Fl_Widget *w, void *data)
 {
 	Fl::paste(*pTable, 1);
 }
+static Fl_Double_Window *pStatsWin = NULL;
+static Fl_Browser *pStats;
+void stats_timer(void *pv)		//refresh the statistics panel while shown
+{
+	if ( !pStatsWin->visible() ) return;
+	char *reply;
+	sql_stats(&reply);
+	int top = pStats->topline();
+	pStats->clear();
+	for ( char *p0=reply, *p1; p0!=NULL; p0=p1 ) {
+		p1 = strchr(p0, '\n');
+		if ( p1!=NULL ) *p1++ = 0;
+		pStats->add(p0);
+	}
+	pStats->topline(top);
+	free(reply);
+	Fl::repeat_timeout(2, stats_timer);
+}
+void stats_callback(Fl_Widget *w, void *data)
+{
+	static const int widths[] = { 72, 64, 72, 72, 72, 72, 80, 80, 112, 0 };
+	if ( pStatsWin==NULL ) {
+		pStatsWin = new Fl_Double_Window(1024, 400, "Query statistics");
+		pStats = new Fl_Browser(0, 0, 1024, 400);
+		pStats->column_char('\t');
+		pStats->column_widths(widths);
+		pStats->format_char(0);
+		pStats->textsize(14);
+		pStatsWin->resizable(pStats);
+		pStatsWin->end();
+	}
+	pStatsWin->show();
+	Fl::remove_timeout(stats_timer);
+	Fl::add_timeout(0, stats_timer);
+}
+//Escape stops a slow table query, from whichever widget has the focus
+int event_dispatch(int e, Fl_Window *w)
+{
+	if ( e==FL_KEYDOWN && Fl::event_key()==FL_Escape &&
+		 pTable!=NULL && pTable->load_busy() ) {
+		pTable->load_cancel();
+		return 1;
+	}
+	return Fl::handle_(e, w);
+}
 int httport;
 void about_callback(Fl_Widget *w, void *data)
 {
@@ -188,8 +355,13 @@ int main(int argc, char **argv)
 		pMenu=new Fl_Sys_Menu_Bar(0, 0, pTableWin->w() ,MENUHEIGHT);
 		pMenu->add("Database/Open...", 	"#o",	dbopen_callback, NULL);
 		pMenu->add("Database/Save...", 	"#s",	dbsave_callback, NULL);
+		pMenu->add("Database/Save Compacted...", 0, dbsave_callback, (void *)1);
+		pMenu->add("Database/Cancel Save", 0,	savecancel_callback, NULL);
+		pMenu->add("Database/Statistics", 0,	stats_callback, NULL);
 		pMenu->add("Database/About", 	"#a",	about_callback, NULL, FL_MENU_DIVIDER);
-		pMenu->add("Table/Export...", 	0,		csvsave_callback, NULL, FL_MENU_DIVIDER);
+		pMenu->add("Table/Import...", 	0,		import_callback, NULL);
+		pMenu->add("Table/Export...", 	0,		csvsave_callback, NULL);
+		pMenu->add("Table/Cancel Export", 0,	exportcancel_callback, NULL, FL_MENU_DIVIDER);
 		pMenu->add("Script/Run...", 	0, 		rowcopy_callback, 0);
 		pMenu->textsize(18);
 		pTable = new sqlTable(0, MENUHEIGHT, pTableWin->w(),
@@ -202,6 +374,10 @@ int main(int argc, char **argv)
 		pCmd->textsize(16);
 		pCmd->when(FL_WHEN_ENTER_KEY_ALWAYS);
 		pCmd->callback(cmd_callback);
+		pProgress = new Fl_Progress(pTableWin->w()-200, pTableWin->h()-CMDHEIGHT,
+									200, CMDHEIGHT);
+		pProgress->selection_color(FL_DARK_GREEN);
+		pProgress->hide();
 		pTableWin->resizable(*pTable);
 		pTableWin->end();
 	}
@@ -210,8 +386,10 @@ int main(int argc, char **argv)
 #endif
 	pTableWin->show();
 
+	if ( argc>2 ) db_profile = argv[2];	//flTable file.db [ingest-heavy|...]
 	if ( argc>1 ) table_open(argv[1]);
 	Fl::add_timeout(1, second_timer);
+	Fl::event_dispatch(event_dispatch);
 	while ( Fl::wait() ) {
 		Fl_Widget *w = (Fl_Widget *)Fl::thread_message();
 		if ( w!=NULL ) w->redraw();
@@ -229,14 +407,98 @@ const char HEADER[]="HTTP/1.1 %s\
 					\nContent-length: %d\
 					\nConnection: Keep-Alive\
 					\nCache-Control: no-cache\n\n";	//max-age=1
-void httpCGI( int http_s1, char *buf )
+const char HEADER_CHUNKED[]="HTTP/1.1 %s\
+					\nServer: flTable-httpd\
+					\nAccess-Control-Allow-Origin: *\
+					\nContent-Type: %s\
+					\nTransfer-Encoding: chunked\
+					\nConnection: Keep-Alive\
+					\nCache-Control: no-cache\n\n";
+struct http_stream {
+	int http_s1;
+	const char *type;		//Content-Type of the reply
+	int started;			//true once the header has been sent
+};
+//sends each chunk of a select result as it is produced, a failed send means
+//the client has gone away and cancels the query
+static int http_sink(void *data, const char *buf, int len)
+{
+	http_stream *hs = (http_stream *)data;
+	char hdr[1024];
+	int l = 0;
+	if ( !hs->started ) {
+		l = sprintf(hdr, HEADER_CHUNKED, "200 OK", hs->type);
+		hs->started = true;
+	}
+	l += sprintf(hdr+l, "%x\r\n", len);
+	if ( send(hs->http_s1, hdr, l, MSG_NOSIGNAL)<0 ) return -1;
+	if ( send(hs->http_s1, buf, len, MSG_NOSIGNAL)<0 ) return -1;
+	if ( send(hs->http_s1, "\r\n", 2, MSG_NOSIGNAL)<0 ) return -1;
+	return len;
+}
+//imports a file into a table, replying when it is done
+static int httpImport( char *cmd, char **preply )
+{
+	char *fn = strchr(cmd, ' ');
+	if ( fn==NULL ) {
+		*preply = strdup("IMP=<table> <file>");
+		return strlen(*preply);
+	}
+	*fn++ = 0;
+	void *imp = sql_import(fn, cmd);
+	if ( imp==NULL ) {
+		*preply = strdup("A table import is already running");
+		return strlen(*preply);
+	}
+	sqlite3_int64 rows;
+	double secs;
+	int percent, state;
+	while ( (state=sql_import_progress(imp, &rows, &secs, &percent))==1 )
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	char msg[256];
+	if ( state==0 )
+		snprintf(msg, 256, "%lld rows imported into %s in %.1f seconds, "
+					"%.0f rows/s", (long long)rows, cmd, secs,
+					secs>0 ? rows/secs : 0);
+	else
+		snprintf(msg, 256, "%s", sql_errmsg());
+	*preply = strdup(msg);
+	return strlen(*preply);
+}
+//returns false when the connection has to be closed, a select that fails
+//after its first chunk is cut off without the last chunk so the client
+//can't take the result for a whole one
+int httpCGI( int http_s1, char *buf )
 {
 	for ( char *p=buf; *p; p++ ) if ( *p=='+' ) *p=' ';
 	fl_decode_uri(buf);
 
 	int replen = 0;
 	char *reply=NULL;
-	if ( strncmp(buf, "SQL=", 4)==0 )
+	int binary = strncmp(buf, "BIN=select ", 11)==0;	//see doc/fltb.js
+	int arrow = strncmp(buf, "ARW=select ", 11)==0;		//Arrow IPC stream
+	if ( binary || arrow || strncmp(buf, "SQL=select ", 11)==0 ) {
+		http_stream hs = { http_s1, binary ? "application/octet-stream" :
+							arrow ? "application/vnd.apache.arrow.stream" :
+											"text/plain", false };
+		int rc;
+		if ( binary )				//ends with its own error message
+			rc = sql_stream_binary( buf+4, http_sink, &hs );
+		else if ( arrow )
+			rc = sql_stream_arrow( buf+4, http_sink, &hs );
+		else
+			rc = sql_stream( buf+4, http_sink, &hs );
+		if ( hs.started ) {
+			if ( rc<0 && !binary ) return false;
+			send( http_s1, "0\r\n\r\n", 5, MSG_NOSIGNAL );
+			return true;
+		}
+		reply = strdup( sql_errmsg() );	//failed before the first chunk
+		if ( reply!=NULL ) replen = strlen(reply);
+	}
+	else if ( strncmp(buf, "IMP=", 4)==0 )	//IMP=<table> <file>
+		replen = httpImport( buf+4, &reply );
+	else if ( strncmp(buf, "SQL=", 4)==0 )
 		replen = sql_table( buf+4, &reply );
 
 	int len = sprintf( buf, HEADER, "200 OK", replen );
@@ -245,6 +507,16 @@ void httpCGI( int http_s1, char *buf )
 		send( http_s1, reply, replen, 0 );
 		free(reply);
 	}
+	return true;
+}
+void httpStats( int http_s1 )	//GET /stats, per query latency histograms
+{
+	char buf[1024], *reply;
+	int replen = sql_stats(&reply);
+	int len = sprintf( buf, HEADER, "200 OK", replen );
+	send( http_s1, buf, len, 0 );
+	if ( replen>0 ) send( http_s1, reply, replen, 0 );
+	free(reply);
 }
 void httpSession( int http_s1 )
 {
@@ -256,8 +528,11 @@ void httpSession( int http_s1 )
 			cmd = buf+5;
 			char *p = strchr(cmd, ' ');
 			if ( p!=NULL ) *p = 0;
-			if ( *cmd=='?' )
-				httpCGI(http_s1, ++cmd);
+			if ( *cmd=='?' ) {
+				if ( !httpCGI(http_s1, ++cmd) ) break;
+			}
+			else if ( strcmp(cmd, "stats")==0 )
+				httpStats(http_s1);
 		}
 		else if ( strncmp(buf, "POST", 4)==0 ) {
 			char *p = strstr(buf, "Content-Length: ");
@@ -287,7 +562,7 @@ void httpSession( int http_s1 )
 				send( http_s1, "Incomplete request", 18, 0);
 				continue;
 			}
-			httpCGI(http_s1, cmd);
+			if ( !httpCGI(http_s1, cmd) ) break;
 		}
 	}
 	closesocket(http_s1);
@@ -16,94 +16,2063 @@
 //
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <string.h>
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
 #include "sql.h"
 void log_print(const char *name, const char *msg, int len);
 
 #include <mutex>
-#include <queue>
+#include <list>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <deque>
 
-std::mutex db_mutex;
-std::queue<std::string> db_queue;
-sqlite3 *db_read=NULL, *db_write=NULL;
+sqlite3 *db_write=NULL;
+static thread_local std::string last_error;
 
-int sql_open(const char *fn)
+/*********************prepared statement cache*******************************/
+#define STMT_CACHE_SIZE 64
+static std::atomic<int> schema_gen(0);	//bumped by DDL on db_write
+typedef std::pair<std::string, sqlite3_stmt *> stmt_entry;
+struct stmt_cache {
+	std::mutex mtx;
+	std::list<stmt_entry> lru;		//most recently used at front
+	std::unordered_map<std::string, std::list<stmt_entry>::iterator> map;
+	int gen = 0;
+	int hits = 0;
+	int misses = 0;
+};
+static stmt_cache write_cache;
+
+static void stmt_flush(stmt_cache &c)
+{
+	for ( auto &e : c.lru ) sqlite3_finalize(e.second);
+	c.lru.clear();
+	c.map.clear();
+}
+//a cached statement is checked out while in use, so two threads running
+//the same sql on one connection never step the same sqlite3_stmt
+static sqlite3_stmt *stmt_get(stmt_cache &c, sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *res = NULL;
+	c.mtx.lock();
+	if ( c.gen!=schema_gen ) {
+		stmt_flush(c);
+		c.gen = schema_gen;
+	}
+	auto it = c.map.find(sql);
+	if ( it!=c.map.end() ) {
+		res = it->second->second;
+		c.lru.erase(it->second);
+		c.map.erase(it);
+		c.hits++;
+	}
+	else
+		c.misses++;
+	c.mtx.unlock();
+
+	if ( res==NULL && sqlite3_prepare_v2(db, sql, -1, &res, NULL)!=SQLITE_OK ) {
+		sqlite3_finalize(res);
+		res = NULL;
+	}
+	return res;
+}
+static void stmt_put(stmt_cache &c, const char *sql, sqlite3_stmt *res)
+{
+	if ( res==NULL ) return;
+	sqlite3_reset(res);
+	sqlite3_clear_bindings(res);
+	c.mtx.lock();
+	if ( c.gen!=schema_gen || c.map.find(sql)!=c.map.end() ) {
+		sqlite3_finalize(res);		//stale, or another copy already cached
+	}
+	else {
+		c.lru.push_front(stmt_entry(sql, res));
+		c.map[sql] = c.lru.begin();
+		if ( c.lru.size()>STMT_CACHE_SIZE ) {
+			c.map.erase(c.lru.back().first);
+			sqlite3_finalize(c.lru.back().second);
+			c.lru.pop_back();
+		}
+	}
+	c.mtx.unlock();
+}
+static int schema_authorizer(void *data, int action, const char *p1,
+								const char *p2, const char *p3, const char *p4)
+{
+	switch ( action ) {
+	case SQLITE_CREATE_INDEX: case SQLITE_CREATE_TABLE:
+	case SQLITE_CREATE_TEMP_INDEX: case SQLITE_CREATE_TEMP_TABLE:
+	case SQLITE_CREATE_TEMP_TRIGGER: case SQLITE_CREATE_TEMP_VIEW:
+	case SQLITE_CREATE_TRIGGER: case SQLITE_CREATE_VIEW:
+	case SQLITE_DROP_INDEX: case SQLITE_DROP_TABLE:
+	case SQLITE_DROP_TEMP_INDEX: case SQLITE_DROP_TEMP_TABLE:
+	case SQLITE_DROP_TEMP_TRIGGER: case SQLITE_DROP_TEMP_VIEW:
+	case SQLITE_DROP_TRIGGER: case SQLITE_DROP_VIEW:
+	case SQLITE_ALTER_TABLE: case SQLITE_ANALYZE:
+	case SQLITE_CREATE_VTABLE: case SQLITE_DROP_VTABLE:
+		schema_gen++;
+		break;
+	case SQLITE_DELETE:				//no truncate, the update hook counts rows
+		if ( sqlite3_strnicmp(p1, "sqlite_", 7)!=0 ) return SQLITE_IGNORE;
+	}
+	return SQLITE_OK;
+}
+/*********************query latency statistics*******************************/
+//every connection reports finished statements through sqlite3_trace_v2,
+//latencies go into a log-linear histogram per query with literals stripped
+#define HIST_SUB		8				//sub-buckets per power of two
+#define HIST_BUCKETS	(HIST_SUB*40)
+struct query_stats {
+	sqlite3_int64 count = 0;
+	sqlite3_int64 total_us = 0;
+	sqlite3_int64 max_us = 0;
+	sqlite3_int64 rows = 0;				//rows returned
+	sqlite3_int64 scanned = 0;			//steps of full table scans
+	unsigned int hist[HIST_BUCKETS] = {0};
+};
+static std::mutex stats_mutex;
+static std::unordered_map<std::string, query_stats> stats_map;
+struct trace_run {						//a statement from its start
+	std::chrono::steady_clock::time_point start;
+	sqlite3_int64 rows = 0;
+};
+//by statement, one can run inside another on the same thread
+static thread_local std::unordered_map<sqlite3_stmt *, trace_run> trace_runs;
+
+static int hist_bucket(sqlite3_int64 us)
+{
+	if ( us<HIST_SUB ) return (int)us;
+	int e = 0;
+	while ( (us>>e)>=HIST_SUB*2 ) e++;
+	int i = HIST_SUB*(e+1)+(int)((us>>e)-HIST_SUB);
+	return i<HIST_BUCKETS ? i : HIST_BUCKETS-1;
+}
+static sqlite3_int64 hist_value(int i)		//upper bound of bucket i
+{
+	if ( i<HIST_SUB ) return i;
+	int e = i/HIST_SUB-1;
+	return ((sqlite3_int64)(HIST_SUB+i%HIST_SUB+1)<<e)-1;
+}
+static sqlite3_int64 hist_percentile(const query_stats &q, double pct)
+{
+	sqlite3_int64 n = 0, target = (sqlite3_int64)(q.count*pct/100+0.5);
+	if ( target<1 ) target = 1;
+	for ( int i=0; i<HIST_BUCKETS; i++ )
+		if ( (n+=q.hist[i])>=target )
+			return std::min(hist_value(i), q.max_us);
+	return q.max_us;
+}
+//string and numeric literals become ?, runs of ?,? collapse into one ?
+static std::string sql_normalize(const char *sql)
+{
+	std::string norm;
+	norm.reserve(strlen(sql));
+	for ( const char *p=sql; *p; p++ ) {
+		char c = *p;
+		if ( c=='\'' ) {					//'it''s' is one literal
+			while ( *++p ) if ( *p=='\'' && *++p!='\'' ) break;
+			p--;
+			c = '?';
+		}
+		else if ( isdigit(c) ) {
+			char prev = norm.empty() ? ' ' : norm.back();
+			if ( isalnum(prev) || prev=='_' ) {	//part of a name like col2
+				norm += c;
+				continue;
+			}
+			while ( isalnum(p[1]) || p[1]=='.' ) p++;
+			c = '?';
+		}
+		else if ( isspace(c) ) {
+			if ( norm.empty() || norm.back()==' ' ) continue;
+			c = ' ';
+		}
+		norm += c;
+		size_t n = norm.size();			//fold "?,?" and "?, ?" lists
+		if ( c=='?' && n>=3 && norm[n-2]==',' && norm[n-3]=='?' )
+			norm.erase(n-2);
+		else if ( c=='?' && n>=4 && norm[n-2]==' ' && norm[n-3]==','
+											&& norm[n-4]=='?' )
+			norm.erase(n-3);
+	}
+	while ( !norm.empty() && norm.back()==' ' ) norm.pop_back();
+	return norm;
+}
+static int trace_callback(unsigned type, void *ctx, void *p, void *x)
+{
+	sqlite3_stmt *res = (sqlite3_stmt *)p;
+	if ( type==SQLITE_TRACE_ROW ) {
+		trace_runs[res].rows++;
+		return 0;
+	}
+	if ( type==SQLITE_TRACE_STMT ) {	//profile time is only in ms on unix
+		if ( strncmp((const char *)x, "--", 2)!=0 ) {	//not a trigger
+			trace_run &run = trace_runs[res];
+			run.start = std::chrono::steady_clock::now();
+			run.rows = 0;
+		}
+		return 0;
+	}
+	auto it = trace_runs.find(res);
+	if ( it==trace_runs.end() ) return 0;
+	trace_run run = it->second;
+	trace_runs.erase(it);
+	const char *sql = sqlite3_sql(res);
+	if ( sql==NULL ) return 0;
+	sqlite3_int64 us = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now()-run.start).count();
+	sqlite3_int64 scanned = sqlite3_stmt_status(res,
+									SQLITE_STMTSTATUS_FULLSCAN_STEP, true);
+	std::string key = sql_normalize(sql);
+
+	std::lock_guard<std::mutex> lck(stats_mutex);
+	query_stats &q = stats_map[key];
+	q.count++;
+	q.total_us += us;
+	if ( us>q.max_us ) q.max_us = us;
+	q.rows += run.rows;
+	q.scanned += scanned;
+	q.hist[hist_bucket(us)]++;
+	return 0;
+}
+static void trace_enable(sqlite3 *db)
+{
+	sqlite3_trace_v2(db, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE|
+							SQLITE_TRACE_ROW, trace_callback, NULL);
+}
+//tab separated table of per query latency, busiest first, free() the reply
+int sql_stats(char **preply)
+{
+	std::vector<std::pair<const std::string *, query_stats>> all;
+	stats_mutex.lock();
+	for ( auto &q : stats_map )
+		all.push_back(std::make_pair(&q.first, q.second));
+	std::sort(all.begin(), all.end(), [](
+			const std::pair<const std::string *, query_stats> &a,
+			const std::pair<const std::string *, query_stats> &b) {
+			return a.second.total_us>b.second.total_us; });
+	std::string reply = "total_ms\tcount\tavg_us\tp50_us\tp90_us\tp99_us"
+						"\tmax_us\trows\tfullscan_steps\tquery";
+	char line[256];
+	for ( auto &a : all ) {
+		const query_stats &q = a.second;
+		sprintf(line, "\n%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t",
+				(long long)q.total_us/1000, (long long)q.count,
+				(long long)(q.total_us/q.count),
+				(long long)hist_percentile(q, 50),
+				(long long)hist_percentile(q, 90),
+				(long long)hist_percentile(q, 99), (long long)q.max_us,
+				(long long)q.rows, (long long)q.scanned);
+		reply += line;
+		reply += *a.first;
+	}
+	stats_mutex.unlock();
+	int hits, misses;
+	sql_cache_stats(&hits, &misses);
+	sprintf(line, "\n\t%d\t\t\t\t\t\t\t\tstatement cache hits", hits);
+	reply += line;
+	sprintf(line, "\n\t%d\t\t\t\t\t\t\t\tstatement cache misses", misses);
+	reply += line;
+	*preply = strdup(reply.c_str());
+	return *preply==NULL ? 0 : reply.length();
+}
+/*********************storage profiles***************************************/
+struct sql_profile {
+	const char *name;
+	const char *journal_mode;
+	sqlite3_int64 mmap_size;
+	int cache_size;				//negative means KiB, as in PRAGMA cache_size
+	int temp_store;				//0 default, 1 file, 2 memory
+	int synchronous;			//0 off, 1 normal, 2 full
+	int checkpoint_ms;			//checkpointer interval, 0 for none
+	int in_memory;				//load the file into a shared memory db
+};
+static const sql_profile profiles[] = {
+	{ "ingest-heavy", "WAL", 64<<20, -65536, 2, 1, 1000, false },
+	{ "read-heavy", "WAL", 256<<20, -262144, 2, 1, 5000, false },
+	{ "in-memory", "MEMORY", 0, -524288, 2, 0, 0, true },
+};
+static const sql_profile *db_profile = profiles+1;
+
+static void profile_apply(sqlite3 *db, const sql_profile *p, int writer)
+{
+	char pragma[256];
+	if ( writer ) {
+		sprintf(pragma, "PRAGMA journal_mode=%s; PRAGMA synchronous=%d",
+						p->journal_mode, p->synchronous);
+		sqlite3_exec(db, pragma, NULL, NULL, NULL);
+	}
+	else if ( p->in_memory )	//shared cache, don't wait on table locks
+		sqlite3_exec(db, "PRAGMA read_uncommitted=1", NULL, NULL, NULL);
+	sprintf(pragma, "PRAGMA mmap_size=%lld; PRAGMA cache_size=%d; "
+					"PRAGMA temp_store=%d", (long long)p->mmap_size,
+					p->cache_size, p->temp_store);
+	sqlite3_exec(db, pragma, NULL, NULL, NULL);
+}
+
+//checkpoints run on their own connection so they never land on a commit,
+//passive while the WAL is growing, truncate once the writer has gone idle
+static std::thread ckpt_thread;
+static std::mutex ckpt_mutex;
+static std::condition_variable ckpt_cv;
+static bool ckpt_stop = false;
+static void checkpointer(std::string uri, int interval_ms)
+{
+	sqlite3 *db;
+	if ( sqlite3_open_v2(uri.c_str(), &db, SQLITE_OPEN_READWRITE|
+						SQLITE_OPEN_URI|SQLITE_OPEN_NOMUTEX, NULL)!=SQLITE_OK ) {
+		sqlite3_close(db);
+		return;
+	}
+	sqlite3_exec(db, "PRAGMA schema_version", NULL, NULL, NULL);//opens WAL
+	int last_log = -1;
+	std::unique_lock<std::mutex> lck(ckpt_mutex);
+	while ( !ckpt_cv.wait_for(lck, std::chrono::milliseconds(interval_ms),
+										[]{ return ckpt_stop; }) ) {
+		lck.unlock();
+		int log = 0, ckpt = 0;
+		sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+															&log, &ckpt);
+		if ( log>0 && log==last_log && ckpt==log ) {
+			sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+															&log, &ckpt);
+			if ( log==0 ) last_log = 0;
+		}
+		else
+			last_log = log;
+		lck.lock();
+	}
+	lck.unlock();
+	sqlite3_close(db);
+}
+static void checkpointer_stop()
+{
+	if ( !ckpt_thread.joinable() ) return;
+	ckpt_mutex.lock();
+	ckpt_stop = true;
+	ckpt_mutex.unlock();
+	ckpt_cv.notify_all();
+	ckpt_thread.join();
+	ckpt_stop = false;
+}
+/*********************per thread reader connections**************************/
+//every thread reading the database gets its own connection, opened on first
+//use without shared cache, so readers only contend on the WAL, not on locks
+static std::string db_uri;
+static std::atomic<int> db_gen(0);		//bumped by every sql_open/sql_close
+struct db_reader {
+	std::mutex mtx;					//held by the owner thread while in use
+	std::mutex db_mtx;				//held to change db, or to interrupt it
+	sqlite3 *db = NULL;
+	std::atomic<int> gen{-1};
+	stmt_cache cache;
+};
+static std::mutex pool_mutex;
+static std::list<db_reader *> reader_pool;
+static int retired_hits = 0, retired_misses = 0;
+
+static void reader_close(db_reader *r)
+{
+	stmt_flush(r->cache);
+	r->db_mtx.lock();
+	sqlite3_close(r->db);
+	r->db = NULL;
+	r->db_mtx.unlock();
+	r->gen = -1;
+}
+struct reader_slot {
+	db_reader *r = NULL;
+	~reader_slot() {				//thread exit, e.g. an http session
+		if ( r==NULL ) return;
+		pool_mutex.lock();
+		reader_pool.remove(r);
+		retired_hits += r->cache.hits;
+		retired_misses += r->cache.misses;
+		pool_mutex.unlock();
+		reader_close(r);
+		delete r;
+	}
+};
+static thread_local reader_slot this_reader;
+
+static db_reader *reader_this()			//the calling thread's, opened later
+{
+	db_reader *r = this_reader.r;
+	if ( r==NULL ) {
+		r = this_reader.r = new db_reader;
+		pool_mutex.lock();
+		reader_pool.push_back(r);
+		pool_mutex.unlock();
+	}
+	return r;
+}
+//returns the calling thread's reader locked, release with reader_put()
+static db_reader *reader_get()
+{
+	db_reader *r = reader_this();
+	std::string uri;
+	const sql_profile *profile = NULL;
+	int gen = -1;
+	while ( true ) {
+		if ( r->gen!=db_gen && gen!=db_gen ) {
+			pool_mutex.lock();
+			gen = db_gen;
+			uri = db_uri;
+			profile = db_profile;
+			pool_mutex.unlock();
+		}
+		r->mtx.lock();
+		if ( r->gen==db_gen ) return r;
+		if ( gen==db_gen ) break;
+		r->mtx.unlock();			//reopened or closed meanwhile, retry
+	}
+	reader_close(r);
+	sqlite3 *db = NULL;
+	if ( sqlite3_open_v2(uri.c_str(), &db, SQLITE_OPEN_READONLY|
+						SQLITE_OPEN_URI|SQLITE_OPEN_NOMUTEX, NULL)==SQLITE_OK ) {
+		sqlite3_busy_timeout(db, 1000);
+		profile_apply(db, profile, false);
+		trace_enable(db);
+	}
+	r->db_mtx.lock();
+	r->db = db;
+	r->db_mtx.unlock();
+	r->gen = gen;
+	return r;
+}
+static void reader_put(db_reader *r)
+{
+	r->mtx.unlock();
+}
+//the calling thread's reader, for sql_interrupt() from another thread
+void *sql_reader()
+{
+	return reader_this();
+}
+//stops the query running on that reader, it returns as failed. A no-op
+//when nothing runs there or the thread has exited meanwhile
+void sql_interrupt(void *reader)
+{
+	std::lock_guard<std::mutex> lck(pool_mutex);
+	for ( auto r : reader_pool ) {
+		if ( r!=reader ) continue;
+		std::lock_guard<std::mutex> db_lck(r->db_mtx);
+		if ( r->db!=NULL ) sqlite3_interrupt(r->db);
+	}
+}
+void sql_cache_stats(int *hits, int *misses)
+{
+	write_cache.mtx.lock();
+	*hits = write_cache.hits;
+	*misses = write_cache.misses;
+	write_cache.mtx.unlock();
+	pool_mutex.lock();
+	*hits += retired_hits;
+	*misses += retired_misses;
+	for ( auto r : reader_pool ) {
+		r->cache.mtx.lock();
+		*hits += r->cache.hits;
+		*misses += r->cache.misses;
+		r->cache.mtx.unlock();
+	}
+	pool_mutex.unlock();
+}
+/*********************writer thread******************************************/
+//db_write is owned by one thread, every write is queued to it and committed
+//in groups of up to GROUP_STATEMENTS or GROUP_MS, whichever comes first.
+//The queue is a lock free ring of preallocated slots, producers claim a slot
+//with one CAS and format straight into it, the writer executes the text in
+//place and hands the slot back, so a queued statement costs no allocation
+#define WRITE_QUEUE_SIZE	4096			//must be a power of 2
+#define SLOT_TEXT			480
+#define SLOT_KEEP			(64<<10)	//overflow bytes a slot keeps once popped
+#define GROUP_STATEMENTS	1024
+#define GROUP_MS			100
+#define COUNT_EXTERNAL_MS	100			//between data_version checks, on the writer
+struct write_slot {
+	std::atomic<size_t> seq;
+	char text[SLOT_TEXT];
+	std::string overflow;			//statements longer than SLOT_TEXT
+	int tmpl;						//sql_ingest template, -1 sql text, -2 batch
+	size_t len;						//bytes of encoded sql_ingest parameters
+	sqlite3_callback cb;
+	void *data;
+	std::promise<int> *done;		//fulfilled after commit, NULL if no waiter
+	std::string *errmsg;			//owned by the waiter, may be NULL
+	const char *sql() { return overflow.empty() ? text : overflow.c_str(); }
+	void put(const void *p, size_t n) {		//append an ingest parameter
+		if ( overflow.empty() && len+n<=SLOT_TEXT )
+			memcpy(text+len, p, n);
+		else {
+			if ( overflow.empty() ) overflow.assign(text, len);
+			overflow.append((const char *)p, n);
+		}
+		len += n;
+	}
+};
+static write_slot *write_slots = NULL;
+static std::atomic<size_t> enq_pos(0);
+static size_t deq_pos = 0;					//only touched by the writer
+static std::atomic<int> producers(0);		//inside reserve..publish
+static std::atomic<bool> writer_running(false), writer_idle(false);
+static std::atomic<bool> wq_stop(false);
+static std::mutex wq_mutex;					//only to sleep/wake the writer
+static std::condition_variable wq_not_empty;
+static std::thread writer_thread;
+
+//claims the next free slot, spins then sleeps while the ring is full
+static write_slot *writer_reserve(size_t &pos)
+{
+	producers++;
+	int spins = 0;
+	pos = enq_pos.load(std::memory_order_relaxed);
+	while ( writer_running ) {
+		write_slot *slot = write_slots+(pos&(WRITE_QUEUE_SIZE-1));
+		size_t seq = slot->seq.load(std::memory_order_acquire);
+		intptr_t dif = (intptr_t)seq-(intptr_t)pos;
+		if ( dif==0 ) {
+			if ( enq_pos.compare_exchange_weak(pos, pos+1,
+										std::memory_order_relaxed) )
+				return slot;
+		}
+		else {
+			if ( dif<0 ) {					//full, writer is a lap behind
+				if ( ++spins<64 )
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			pos = enq_pos.load(std::memory_order_relaxed);
+		}
+	}
+	producers--;
+	return NULL;
+}
+static void writer_publish(write_slot *slot, size_t pos)
+{
+	slot->seq.store(pos+1, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if ( writer_idle ) {
+		wq_mutex.lock();
+		wq_mutex.unlock();
+		wq_not_empty.notify_one();
+	}
+	producers--;
+}
+static write_slot *writer_peek()
+{
+	write_slot *slot = write_slots+(deq_pos&(WRITE_QUEUE_SIZE-1));
+	if ( slot->seq.load(std::memory_order_acquire)==deq_pos+1 ) return slot;
+	return NULL;
+}
+static void writer_pop(write_slot *slot)	//a batch's megabytes are let go
+{
+	if ( slot->overflow.capacity()>SLOT_KEEP )
+		std::string().swap(slot->overflow);
+	else
+		slot->overflow.clear();
+	slot->seq.store(deq_pos+WRITE_QUEUE_SIZE, std::memory_order_release);
+	deq_pos++;
+}
+//sleeps until a slot is ready, returns NULL at deadline or when stopped
+static write_slot *writer_wait(std::chrono::steady_clock::time_point deadline)
+{
+	write_slot *slot;
+	while ( (slot=writer_peek())==NULL ) {
+		auto now = std::chrono::steady_clock::now();
+		if ( wq_stop || now>=deadline ) break;
+		std::unique_lock<std::mutex> lck(wq_mutex);
+		writer_idle = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if ( writer_peek()==NULL )
+			wq_not_empty.wait_until(lck, std::min(deadline,
+									now+std::chrono::milliseconds(10)));
+		writer_idle = false;
+	}
+	return slot;
+}
+
+static void count_statement(const char *sql);
+static void count_external();
+static void count_version_open();
+static void count_version_close();
+static void hook_flush();
+static int writer_run(const char *sql, sqlite3_callback cb, void *data,
+						std::string *errmsg, int logged)
+{
+	int rc = SQLITE_OK;
+	if ( *sql==0 ) return true;				//sql_commit() barrier
+	count_statement(sql);
+	if ( cb==NULL || strchr(sql, ';')!=NULL )
+		rc = sqlite3_exec(db_write, sql, cb, data, NULL);
+	else {
+		sqlite3_stmt *res = stmt_get(write_cache, db_write, sql);
+		if ( res==NULL ) rc = sqlite3_errcode(db_write);
+		else {
+			int c = sqlite3_column_count(res);
+			std::vector<char *> argv(c), names(c);
+			for ( int i=0; i<c; i++ )
+				names[i] = (char *)sqlite3_column_name(res, i);
+			while ( (rc=sqlite3_step(res))==SQLITE_ROW ) {
+				for ( int i=0; i<c; i++ )
+					argv[i] = (char *)sqlite3_column_text(res, i);
+				if ( cb(data, c, argv.data(), names.data())!=0 ) {
+					rc = SQLITE_ABORT;
+					break;
+				}
+			}
+			if ( rc==SQLITE_DONE ) rc = SQLITE_OK;
+			stmt_put(write_cache, sql, res);
+		}
+	}
+	if ( rc!=SQLITE_OK && errmsg!=NULL )
+		*errmsg = sqlite3_errmsg(db_write);
+	if ( logged )
+		log_print(rc==SQLITE_OK?"+++":"---", sql, strlen(sql));
+	return rc==SQLITE_OK;
+}
+//sql_ingest() templates, prepared once on db_write and bound per row
+static std::mutex ingest_mutex;
+static std::vector<std::string> ingest_sql;
+static std::vector<sqlite3_stmt *> ingest_stmt;	//writer thread only
+static int ingest_gen = -1;
+
+static void ingest_flush()
+{
+	for ( auto &res : ingest_stmt ) {
+		sqlite3_finalize(res);
+		res = NULL;
+	}
+}
+//binds the encoded parameters p..p+len to template tmpl and steps it
+static int writer_bind(int tmpl, const char *p, size_t len,
+						std::string *errmsg)
+{
+	if ( ingest_gen!=schema_gen ) {
+		ingest_flush();
+		ingest_gen = schema_gen;
+	}
+	if ( tmpl>=(int)ingest_stmt.size() )
+		ingest_stmt.resize(tmpl+1, NULL);
+	sqlite3_stmt *&res = ingest_stmt[tmpl];
+	if ( res==NULL ) {
+		ingest_mutex.lock();
+		std::string sql = ingest_sql[tmpl];
+		ingest_mutex.unlock();
+		if ( sqlite3_prepare_v2(db_write, sql.c_str(), -1, &res,
+											NULL)!=SQLITE_OK ) {
+			if ( errmsg!=NULL ) *errmsg = sqlite3_errmsg(db_write);
+			log_print("---", sql.c_str(), sql.length());
+			return false;
+		}
+	}
+
+	const char *end = p+len;
+	sqlite3_int64 i64;
+	double f;
+	uint32_t n;
+	int i;
+	for ( i=1; p<end; i++ ) {
+		switch ( *p++ ) {
+		case 'i': memcpy(&i64, p, 8); p+=8;
+				sqlite3_bind_int64(res, i, i64); break;
+		case 'f': memcpy(&f, p, 8); p+=8;
+				sqlite3_bind_double(res, i, f); break;
+		case 's': memcpy(&n, p, 4); p+=4;
+				sqlite3_bind_text(res, i, p, n, SQLITE_STATIC); p+=n; break;
+		default: sqlite3_bind_null(res, i);
+		}
+	}
+	int rc = SQLITE_RANGE;			//wrong number of parameters
+	count_statement(sqlite3_sql(res));
+	if ( i-1==sqlite3_bind_parameter_count(res) ) {
+		rc = sqlite3_step(res);
+		if ( rc!=SQLITE_DONE && errmsg!=NULL )
+			*errmsg = sqlite3_errmsg(db_write);
+		sqlite3_reset(res);
+	}
+	else if ( errmsg!=NULL )
+		*errmsg = "wrong number of parameters";
+	if ( rc!=SQLITE_DONE )
+		log_print("---", sqlite3_sql(res), strlen(sqlite3_sql(res)));
+	return rc==SQLITE_DONE;
+}
+static int writer_ingest(write_slot *slot)
+{
+	return writer_bind(slot->tmpl, slot->overflow.empty() ? slot->text :
+							slot->overflow.data(), slot->len, slot->errmsg);
+}
+//a batch is a transaction of its own, all of its rows are kept or none
+static int writer_batch(write_slot *slot)
+{
+	const char *p = slot->overflow.data();
+	const char *end = p+slot->overflow.size();
+	std::string err;
+	if ( sqlite3_exec(db_write, "BEGIN", NULL, NULL, NULL)!=SQLITE_OK ) {
+		if ( slot->errmsg!=NULL ) *slot->errmsg = sqlite3_errmsg(db_write);
+		return false;				//not ours to roll back
+	}
+	for ( int k=1; err.empty() && p<end; k++ ) {
+		int32_t tmpl;
+		uint32_t len;
+		memcpy(&tmpl, p, 4);
+		memcpy(&len, p+4, 4);
+		p += 8;
+		if ( !writer_bind(tmpl, p, len, &err) )
+			err = "row " + std::to_string(k) + ": " + err;
+		p += len;
+	}
+	if ( err.empty() &&
+		 sqlite3_exec(db_write, "COMMIT", NULL, NULL, NULL)!=SQLITE_OK )
+		err = sqlite3_errmsg(db_write);
+	if ( !err.empty() && !sqlite3_get_autocommit(db_write) )
+		sqlite3_exec(db_write, "ROLLBACK", NULL, NULL, NULL);
+	if ( !err.empty() && slot->errmsg!=NULL ) *slot->errmsg = err;
+	return err.empty();
+}
+//registers a statement with ? parameters for sql_ingest(), returns its id
+int sql_ingest_prepare(const char *sql)
+{
+	sqlite3_stmt *res;
+	if ( sqlite3_prepare_v2(db_write, sql, -1, &res, NULL)!=SQLITE_OK ) {
+		last_error = sqlite3_errmsg(db_write);
+		sqlite3_finalize(res);
+		return -1;
+	}
+	sqlite3_finalize(res);
+	std::lock_guard<std::mutex> lck(ingest_mutex);
+	for ( size_t i=0; i<ingest_sql.size(); i++ )
+		if ( ingest_sql[i]==sql ) return i;
+	ingest_sql.push_back(sql);
+	return ingest_sql.size()-1;
+}
+//rows of a batch, each an int32 template, uint32 length and its parameters
+struct write_batch {
+	std::string rec;
+	void put(const void *p, size_t n) { rec.append((const char *)p, n); }
+	size_t row(int32_t tmpl) {
+		uint32_t len = 0;
+		put(&tmpl, 4);
+		put(&len, 4);
+		return rec.size();
+	}
+	void row_end(size_t at) {
+		uint32_t len = rec.size()-at;
+		memcpy(&rec[at-4], &len, 4);
+	}
+};
+//encodes one row of parameters into a slot or a batch
+template<class T>
+static void ingest_put(T &out, const char *types, va_list args)
+{
+	for ( const char *t=types; *t; t++ ) {
+		char tag = *t;
+		sqlite3_int64 i64;
+		double f;
+		const char *s;
+		uint32_t n;
+		switch ( tag ) {
+		case 'i': i64 = va_arg(args, int);
+				out.put(&tag, 1); out.put(&i64, 8); break;
+		case 'l': i64 = va_arg(args, sqlite3_int64); tag = 'i';
+				out.put(&tag, 1); out.put(&i64, 8); break;
+		case 'f': f = va_arg(args, double);
+				out.put(&tag, 1); out.put(&f, 8); break;
+		case 's': s = va_arg(args, const char *);
+				if ( s==NULL ) { tag = 'n'; out.put(&tag, 1); break; }
+				n = strlen(s);
+				out.put(&tag, 1); out.put(&n, 4); out.put(s, n); break;
+		default: tag = 'n'; out.put(&tag, 1);
+		}
+	}
+}
+template<class T>
+static void ingest_put_cells(T &out, int n, const char *const *cells,
+								const int *lens)
+{
+	char tag = 's';
+	for ( int i=0; i<n; i++ ) {
+		uint32_t l = lens[i];
+		out.put(&tag, 1); out.put(&l, 4); out.put(cells[i], l);
+	}
+}
+//queues one row for template id, types has one letter per parameter:
+//i int, l sqlite3_int64, f double, s const char * (NULL binds null), n null
+int sql_ingest(int id, const char *types, ...)
+{
+	if ( id<0 ) return false;
+	size_t pos;
+	write_slot *slot = writer_reserve(pos);
+	if ( slot==NULL ) return false;
+	slot->tmpl = id;
+	slot->len = 0;
+	slot->cb = NULL;
+	slot->errmsg = NULL;
+	slot->done = NULL;
+
+	va_list args;
+	va_start(args, types);
+	ingest_put(*slot, types, args);
+	va_end(args);
+	writer_publish(slot, pos);
+	return true;
+}
+//queues one row of n text cells for template id, cells need not end in 0
+int sql_ingest_cells(int id, int n, const char *const *cells, const int *lens)
+{
+	if ( id<0 ) return false;
+	size_t pos;
+	write_slot *slot = writer_reserve(pos);
+	if ( slot==NULL ) return false;
+	slot->tmpl = id;
+	slot->len = 0;
+	slot->cb = NULL;
+	slot->errmsg = NULL;
+	slot->done = NULL;
+
+	ingest_put_cells(*slot, n, cells, lens);
+	writer_publish(slot, pos);
+	return true;
+}
+//rows that are committed together or not at all, in a transaction that no
+//other producer's statements share: add them with sql_batch_ingest() or
+//sql_batch_cells(), as for sql_ingest(), then sql_batch_commit()
+void *sql_batch()
+{
+	return new write_batch;
+}
+int sql_batch_ingest(void *b, int id, const char *types, ...)
+{
+	if ( id<0 ) return false;
+	write_batch *batch = (write_batch *)b;
+	size_t at = batch->row(id);
+	va_list args;
+	va_start(args, types);
+	ingest_put(*batch, types, args);
+	va_end(args);
+	batch->row_end(at);
+	return true;
+}
+int sql_batch_cells(void *b, int id, int n, const char *const *cells,
+					const int *lens)
+{
+	if ( id<0 ) return false;
+	write_batch *batch = (write_batch *)b;
+	size_t at = batch->row(id);
+	ingest_put_cells(*batch, n, cells, lens);
+	batch->row_end(at);
+	return true;
+}
+//queues the batch, frees it and waits for its commit; false with the
+//error in sql_errmsg() if a row or the commit failed, then no row is kept
+int sql_batch_commit(void *b)
+{
+	write_batch *batch = (write_batch *)b;
+	std::string errmsg;
+	std::future<int> fut;
+	size_t pos;
+	write_slot *slot = writer_reserve(pos);
+	if ( slot==NULL ) {
+		delete batch;
+		last_error = "database not open";
+		return false;
+	}
+	slot->overflow.swap(batch->rec);
+	slot->tmpl = -2;
+	slot->len = slot->overflow.size();
+	slot->cb = NULL;
+	slot->errmsg = &errmsg;
+	slot->done = new std::promise<int>;
+	fut = slot->done->get_future();
+	writer_publish(slot, pos);
+	delete batch;
+	int ok = fut.get();
+	if ( !ok ) last_error = errmsg;
+	return ok;
+}
+//transaction control can't be grouped, such statements run on their own
+static int writer_alone(const char *sql)
+{
+	static const char *verbs[] = { "begin", "commit", "end", "rollback",
+						"savepoint", "release", "vacuum", "attach",
+						"detach", "pragma" };
+	for ( const char *v : verbs )
+		if ( sqlite3_strnicmp(sql, v, strlen(v))==0 ) return true;
+	return false;
+}
+static void writer_settle(std::vector<std::pair<std::promise<int> *, int>> &done,
+							int committed)
+{
+	for ( auto &d : done ) {
+		d.first->set_value(committed && d.second);
+		delete d.first;
+	}
+	done.clear();
+}
+static int writer_commit()
+{
+	if ( sqlite3_exec(db_write, "COMMIT", NULL, NULL, NULL)==SQLITE_OK )
+		return true;
+	sqlite3_exec(db_write, "ROLLBACK", NULL, NULL, NULL);
+	return false;
+}
+static void writer()
+{
+	std::vector<std::pair<std::promise<int> *, int>> done;
+	write_slot *slot;
+	count_version_open();
+	while ( true ) {
+		slot = writer_wait(std::chrono::steady_clock::now()+
+						std::chrono::milliseconds(COUNT_EXTERNAL_MS));
+		if ( slot==NULL ) {
+			if ( wq_stop ) break;
+			count_external();
+			continue;
+		}
+		auto deadline = std::chrono::steady_clock::now()+
+						std::chrono::milliseconds(GROUP_MS);
+		int n = 0, txn = false, begun = false, waiters = false;
+		while ( slot!=NULL ) {
+			const char *sql = slot->sql();
+			int batch = slot->tmpl==-2;
+			int alone = batch || (slot->tmpl==-1 && writer_alone(sql));
+			if ( alone && txn ) {
+				writer_settle(done, writer_commit());
+				hook_flush();
+				txn = false;
+			}
+			if ( alone )
+				begun = false;
+			else if ( !txn && !begun ) {	//once, not again per statement
+				begun = true;
+				txn = sqlite3_get_autocommit(db_write) &&
+					  sqlite3_exec(db_write, "BEGIN", NULL, NULL,
+												NULL)==SQLITE_OK;
+			}
+			std::promise<int> *job_done = slot->done;
+			int rc = batch ? writer_batch(slot) :
+					 slot->tmpl>=0 ? writer_ingest(slot) :
+						writer_run(sql, slot->cb, slot->data, slot->errmsg,
+															job_done==NULL);
+			writer_pop(slot);
+			if ( !txn ) hook_flush();
+			if ( job_done!=NULL ) {
+				if ( txn ) {
+					done.push_back(std::make_pair(job_done, rc));
+					waiters = true;
+				}
+				else {
+					job_done->set_value(rc);
+					delete job_done;
+				}
+			}
+			if ( ++n>=GROUP_STATEMENTS ) break;
+			if ( std::chrono::steady_clock::now()>=deadline ) break;
+			slot = (waiters||wq_stop) ? writer_peek() : writer_wait(deadline);
+		}
+		writer_settle(done, txn ? writer_commit() : true);
+		hook_flush();
+		count_external();
+	}
+	count_version_close();
+}
+static void writer_fill(write_slot *slot, const char *sql, sqlite3_callback cb,
+						void *data, std::future<int> *fut, std::string *errmsg)
+{
+	size_t len = strlen(sql);
+	if ( len<SLOT_TEXT ) {
+		memcpy(slot->text, sql, len+1);
+		slot->overflow.clear();
+	}
+	else
+		slot->overflow.assign(sql, len);
+	slot->tmpl = -1;
+	slot->cb = cb;
+	slot->data = data;
+	slot->errmsg = errmsg;
+	slot->done = NULL;
+	if ( fut!=NULL ) {
+		slot->done = new std::promise<int>;
+		*fut = slot->done->get_future();
+	}
+}
+//blocks while the queue is full, pass fut to be told when it is committed
+static int writer_post(const char *sql, sqlite3_callback cb, void *data,
+						std::future<int> *fut, std::string *errmsg)
+{
+	size_t pos;
+	write_slot *slot = writer_reserve(pos);
+	if ( slot==NULL ) return false;
+	writer_fill(slot, sql, cb, data, fut, errmsg);
+	writer_publish(slot, pos);
+	return true;
+}
+//queue one statement, the future is ready once it has been committed
+std::future<int> sql_async(const char *sql)
+{
+	std::future<int> fut;
+	if ( !writer_post(sql, NULL, NULL, &fut, NULL) ) {
+		std::promise<int> failed;
+		failed.set_value(false);
+		fut = failed.get_future();
+	}
+	return fut;
+}
+static void writer_start()
+{
+	if ( write_slots==NULL ) {
+		write_slots = new write_slot[WRITE_QUEUE_SIZE];
+		for ( size_t i=0; i<WRITE_QUEUE_SIZE; i++ )
+			write_slots[i].seq = i;
+		enq_pos = deq_pos = 0;
+	}
+	wq_stop = false;
+	writer_running = true;
+	writer_thread = std::thread(writer);
+}
+static void writer_stop()
+{
+	if ( !writer_thread.joinable() ) return;
+	writer_running = false;			//no new slots, then let producers finish
+	while ( producers>0 ) std::this_thread::yield();
+	wq_stop = true;
+	wq_mutex.lock();
+	wq_mutex.unlock();
+	wq_not_empty.notify_one();
+	writer_thread.join();			//drains the ring before leaving
+	ingest_flush();
+}
+/*********************row counts*********************************************/
+//COUNT results by table and filter. A whole table count is kept exact by
+//adding the update hook's inserts and deletes as they are committed, a
+//filtered count goes stale on any commit to its table and is counted again
+//in the background when asked for, no more than once per COUNT_MS
+#define COUNT_MS		1000
+#define COUNT_ENTRIES	32
+struct row_count {
+	std::string table, where;
+	int rows = -1;
+	int exact = false;
+	int queued = false;
+	int counting = false;
+	int dirty = false;					//committed to while counting
+	int delta = 0;						//committed since the count's snapshot
+	unsigned used = 0;
+	std::chrono::steady_clock::time_point counted;
+};
+struct count_delta {
+	int rows = 0;
+	int unsure = false;					//REPLACE or ROLLBACK TO, can't tell
+};
+static std::mutex count_mutex;
+static std::condition_variable count_cv;
+static std::map<std::string, row_count> counts;
+static std::deque<std::string> count_queue;
+static std::thread count_thread;
+static bool count_quit = false;
+static sqlite3 *count_db = NULL;		//for sqlite3_interrupt
+static unsigned count_clock = 0;
+static int count_gen = 0;
+static std::unordered_map<std::string, count_delta> count_pending;//writer only
+static int count_replace = false;		//statement may delete without a hook
+static sqlite3_stmt *count_version = NULL;	//PRAGMA data_version on db_write,
+static int count_version_last = 0;		//changes only when another process writes
+static std::chrono::steady_clock::time_point count_version_at;	//writer only
+static std::atomic<unsigned> count_external_gen(0);	//seen by data_version
+static std::mutex hook_mutex;
+static hook_callback user_hook = NULL;
+static void *user_hook_data = NULL;
+struct hook_row {						//held for the user hook until committed
+	int type, db, table;				//names in hook_names
+	sqlite3_int64 rowid;
+};
+static std::vector<hook_row> hook_rows;	//writer only
+static std::vector<std::string> hook_names;
+
+static void count_statement(const char *sql)
+{
+	count_replace = sqlite3_strglob("*[Rr][Ee][Pp][Ll][Aa][Cc][Ee]*", sql)==0;
+	if ( sqlite3_strnicmp(sql, "rollback", 8)==0 )
+		for ( auto &p : count_pending ) p.second.unsure = true;
+}
+static void count_hook(void *data, int type, const char *db_name,
+						const char *tbl_name, sqlite3_int64 rowid)
+{
+	count_delta &d = count_pending[tbl_name];
+	if ( type==SQLITE_INSERT ) d.rows++;
+	if ( type==SQLITE_DELETE ) d.rows--;
+	if ( count_replace ) d.unsure = true;
+	hook_mutex.lock();
+	int hooked = user_hook!=NULL;
+	hook_mutex.unlock();
+	if ( !hooked ) return;
+	int names[2];
+	const char *name[2] = { db_name, tbl_name };
+	for ( int i=0; i<2; i++ ) {
+		names[i] = std::find(hook_names.begin(), hook_names.end(), name[i])-
+															hook_names.begin();
+		if ( names[i]==(int)hook_names.size() ) hook_names.push_back(name[i]);
+	}
+	hook_rows.push_back(hook_row{type, names[0], names[1], rowid});
+}
+//the user hook is told of rows once no transaction is open, so a reader
+//it wakes sees them. Rows rolled back are told too, a spurious refresh
+static void hook_flush()
+{
+	while ( !hook_rows.empty() && sqlite3_get_autocommit(db_write) ) {
+		std::vector<hook_row> rows;
+		rows.swap(hook_rows);
+		hook_mutex.lock();
+		hook_callback cb = user_hook;
+		void *cb_data = user_hook_data;
+		hook_mutex.unlock();
+		for ( auto &h : rows )			//may write, adding to hook_rows
+			if ( cb!=NULL ) cb(cb_data, h.type, hook_names[h.db].c_str(),
+								hook_names[h.table].c_str(), h.rowid);
+	}
+}
+static int count_commit(void *data)
+{
+	std::lock_guard<std::mutex> lck(count_mutex);
+	int ddl = count_gen!=schema_gen;
+	count_gen = schema_gen;
+	for ( auto &c : counts ) {
+		row_count &e = c.second;
+		auto d = count_pending.find(e.table);
+		if ( !ddl && d==count_pending.end() ) continue;
+		int unsure = ddl || d->second.unsure || !e.where.empty();
+		if ( e.counting ) {
+			if ( !ddl ) e.delta += d->second.rows;
+			if ( unsure ) e.dirty = true;
+		}
+		else if ( unsure )
+			e.exact = false;
+		else if ( e.rows>=0 )
+			e.rows += d->second.rows;
+	}
+	count_pending.clear();
+	return 0;
+}
+static void count_rollback(void *data)	//a count cut in the group is off
+{
+	std::lock_guard<std::mutex> lck(count_mutex);
+	for ( auto &c : counts )
+		if ( c.second.counting &&
+			 count_pending.find(c.second.table)!=count_pending.end() )
+			c.second.dirty = true;
+	count_pending.clear();
+}
+
+//called on the writer thread, where no commit can be half done: counts
+//committed from here on go to delta, the reader's snapshot has the rest.
+//Readers of an in-memory database see uncommitted rows and have no
+//snapshot, the count is taken here on the writer, which sees its open
+//group, and the group's rows are taken off delta before it commits them
+struct count_job {
+	std::string key, sql;
+	sqlite3 *db;
+	int rows = -1;						//counted on the writer
+	std::promise<void> cut;
+};
+static int count_cut(void *data, int argc, char **argv, char **names)
+{
+	count_job *job = (count_job *)data;
+	if ( db_profile->in_memory ) {
+		sqlite3_stmt *res = NULL;
+		if ( sqlite3_prepare_v2(db_write, job->sql.c_str(), -1, &res,
+								NULL)==SQLITE_OK &&
+			 sqlite3_step(res)==SQLITE_ROW )
+			job->rows = sqlite3_column_int(res, 0);
+		sqlite3_finalize(res);
+	}
+	count_mutex.lock();
+	auto it = counts.find(job->key);
+	if ( it!=counts.end() ) {
+		auto d = count_pending.find(it->second.table);
+		int open = job->rows>=0 && d!=count_pending.end();
+		it->second.delta = open ? -d->second.rows : 0;
+		it->second.dirty = open && d->second.unsure;
+	}
+	count_mutex.unlock();
+	if ( job->rows<0 )
+		sqlite3_exec(job->db, "BEGIN; SELECT count(*) FROM sqlite_master",
+															NULL, NULL, NULL);
+	job->cut.set_value();
+	return 0;
+}
+static void counter()
+{
+	std::unique_lock<std::mutex> lck(count_mutex);
+	while ( true ) {
+		count_cv.wait(lck, []{ return count_quit || !count_queue.empty(); });
+		if ( count_quit ) break;
+		std::string key = count_queue.front();
+		count_queue.pop_front();
+		auto it = counts.find(key);
+		if ( it==counts.end() ) continue;
+		it->second.queued = false;
+		it->second.counting = true;
+		std::string sql = "select count(*) from " + it->second.table;
+		if ( !it->second.where.empty() ) sql += " where " + it->second.where;
+		lck.unlock();
+
+		int rows = -1;
+		db_reader *r = reader_get();
+		count_job job;
+		job.key = key;
+		job.sql = sql;
+		job.db = r->db;
+		std::future<void> cut = job.cut.get_future();
+		std::future<int> run;
+		if ( writer_post("select 1", count_cut, &job, &run, NULL) ) {
+			while ( cut.wait_for(std::chrono::milliseconds(10))!=
+											std::future_status::ready )
+				if ( run.wait_for(std::chrono::seconds(0))==
+											std::future_status::ready ) break;
+			if ( cut.wait_for(std::chrono::seconds(0))==
+						std::future_status::ready && job.rows>=0 )
+				rows = job.rows;
+			else if ( cut.wait_for(std::chrono::seconds(0))==
+											std::future_status::ready ) {
+				lck.lock();
+				count_db = r->db;
+				lck.unlock();
+				sqlite3_stmt *res = stmt_get(r->cache, r->db, sql.c_str());
+				if ( res!=NULL && sqlite3_step(res)==SQLITE_ROW )
+					rows = sqlite3_column_int(res, 0);
+				stmt_put(r->cache, sql.c_str(), res);
+				sqlite3_exec(r->db, "COMMIT", NULL, NULL, NULL);
+				lck.lock();
+				count_db = NULL;
+				lck.unlock();
+			}
+		}
+		reader_put(r);
+
+		lck.lock();
+		it = counts.find(key);
+		if ( it==counts.end() ) continue;
+		row_count &e = it->second;
+		e.counting = false;
+		e.counted = std::chrono::steady_clock::now();
+		if ( rows>=0 ) {
+			e.rows = rows + (e.where.empty() ? e.delta : 0);
+			e.exact = !e.dirty;
+		}
+	}
+}
+//data_version is read on the writer thread only, never under count_mutex:
+//the commit hook takes count_mutex while db_write is held
+static void count_version_open()
+{
+	if ( sqlite3_prepare_v2(db_write, "PRAGMA data_version", -1,
+							&count_version, NULL)==SQLITE_OK &&
+		 sqlite3_step(count_version)==SQLITE_ROW )
+		count_version_last = sqlite3_column_int(count_version, 0);
+	sqlite3_reset(count_version);
+	count_version_at = std::chrono::steady_clock::now();
+}
+static void count_version_close()
 {
-	if ( db_read!=NULL ) sqlite3_close(db_read);
-	if ( db_write!=NULL ) sqlite3_close(db_write);
-	char uri[4096];
-	sprintf(uri, "file:%s?cache=shared", fn);
- 	return (sqlite3_open(uri, &db_read )==SQLITE_OK &&
-			sqlite3_open(uri, &db_write)==SQLITE_OK );
+	sqlite3_finalize(count_version);
+	count_version = NULL;
+}
+//another process committed when data_version moves, not seen by the update
+//hook, checked at most every COUNT_EXTERNAL_MS
+static void count_external()
+{
+	auto now = std::chrono::steady_clock::now();
+	if ( count_version==NULL || now-count_version_at<
+						std::chrono::milliseconds(COUNT_EXTERNAL_MS) ) return;
+	count_version_at = now;
+	int v = count_version_last;
+	if ( sqlite3_step(count_version)==SQLITE_ROW )
+		v = sqlite3_column_int(count_version, 0);
+	sqlite3_reset(count_version);
+	if ( v==count_version_last ) return;
+	count_version_last = v;
+	std::lock_guard<std::mutex> lck(count_mutex);
+	count_external_gen++;
+	for ( auto &c : counts ) {
+		if ( c.second.counting ) c.second.dirty = true;
+		else c.second.exact = false;
+	}
+}
+//rows in table matching where, "" for all, returns true when *rows is
+//exact, false while it is the last count or -1 before the first one
+int sql_count(const char *table, const char *where, int *rows)
+{
+	std::string key = std::string(table) + " where " + where;
+	std::unique_lock<std::mutex> lck(count_mutex);
+	*rows = -1;
+	if ( !count_thread.joinable() ) return false;
+	auto it = counts.find(key);
+	if ( it==counts.end() ) {
+		if ( counts.size()>=COUNT_ENTRIES ) {	//least recently asked for
+			auto old = counts.end();
+			for ( auto c=counts.begin(); c!=counts.end(); c++ )
+				if ( !c->second.queued && !c->second.counting &&
+					 (old==counts.end() || c->second.used<old->second.used) )
+					old = c;
+			if ( old!=counts.end() ) counts.erase(old);
+		}
+		it = counts.insert(std::make_pair(key, row_count())).first;
+		it->second.table = table;
+		it->second.where = where;
+	}
+	row_count &e = it->second;
+	e.used = ++count_clock;
+	if ( !e.exact && !e.queued && !e.counting &&
+		 std::chrono::steady_clock::now()-e.counted>=
+								std::chrono::milliseconds(COUNT_MS) ) {
+		e.queued = true;
+		count_queue.push_back(key);
+		count_cv.notify_one();
+	}
+	*rows = e.rows;
+	return e.exact;
+}
+//bumped when another process commits to the database, as seen by the
+//writer; a plain load, the caller never waits on the writer or db_write
+unsigned sql_version()
+{
+	return count_external_gen;
+}
+static void counter_start()
+{
+	counts.clear();
+	count_queue.clear();
+	count_pending.clear();
+	hook_rows.clear();
+	count_gen = schema_gen;
+	count_quit = false;
+	sqlite3_update_hook(db_write, count_hook, NULL);
+	sqlite3_commit_hook(db_write, count_commit, NULL);
+	sqlite3_rollback_hook(db_write, count_rollback, NULL);
+	count_thread = std::thread(counter);
+}
+static void counter_stop()
+{
+	if ( !count_thread.joinable() ) return;
+	count_mutex.lock();
+	count_quit = true;
+	if ( count_db!=NULL ) sqlite3_interrupt(count_db);
+	count_mutex.unlock();
+	count_cv.notify_all();
+	count_thread.join();
+}
+/****************************************************************************/
+//a file name as a URI path, ? # and % would otherwise end or escape it
+static std::string uri_path(const char *fn)
+{
+	std::string uri = "file:";
+	for ( const char *p=fn; *p; p++ ) {
+		if ( *p=='?' || *p=='#' || *p=='%' ) {
+			char hex[4];
+			sprintf(hex, "%%%02X", (unsigned char)*p);
+			uri += hex;
+		}
+		else
+			uri += *p;
+	}
+	return uri;
+}
+//profile is one of "ingest-heavy", "read-heavy" or "in-memory", the last
+//loads the file into a memory database, changes persist only by sql_save()
+int sql_open(const char *fn, const char *profile)
+{
+	sql_close();
+	const sql_profile *p = profiles+1;
+	if ( profile!=NULL ) {
+		for ( p=profiles; p<profiles+3; p++ )
+			if ( strcmp(p->name, profile)==0 ) break;
+		if ( p==profiles+3 ) return false;
+	}
+
+	std::string uri;
+	if ( p->in_memory ) {
+		char mem[64];
+		sprintf(mem, "file:flTable-%d?mode=memory&cache=shared", (int)db_gen);
+		uri = mem;
+	}
+	else
+		uri = uri_path(fn);
+	if ( sqlite3_open_v2(uri.c_str(), &db_write, SQLITE_OPEN_READWRITE|
+				SQLITE_OPEN_CREATE|SQLITE_OPEN_URI, NULL)!=SQLITE_OK ) {
+		sqlite3_close(db_write);
+		db_write = NULL;
+		return false;
+	}
+	if ( p->in_memory ) {
+		sqlite3 *src;
+		if ( sqlite3_open_v2(fn, &src, SQLITE_OPEN_READONLY, NULL)==SQLITE_OK ) {
+			sqlite3_backup *pBackup;
+			pBackup = sqlite3_backup_init(db_write, "main", src, "main");
+			if ( pBackup ) {
+				sqlite3_backup_step(pBackup, -1);
+				sqlite3_backup_finish(pBackup);
+			}
+		}
+		sqlite3_close(src);
+	}
+	sqlite3_busy_timeout(db_write, 1000);
+	sqlite3_set_authorizer(db_write, schema_authorizer, NULL);
+	trace_enable(db_write);
+	profile_apply(db_write, p, true);
+	if ( p->checkpoint_ms>0 ) {
+		sqlite3_wal_autocheckpoint(db_write, 0);
+		ckpt_thread = std::thread(checkpointer, uri, p->checkpoint_ms);
+	}
+	pool_mutex.lock();
+	db_uri = uri;
+	db_profile = p;
+	db_gen++;
+	pool_mutex.unlock();
+	writer_start();
+	counter_start();
+	return true;
 }
 int sql_close()
 {
-	sql_commit();
-	sqlite3_close(db_read);
+	sql_save_cancel();
+	sql_import_cancel();
+	sql_export_cancel();
+	counter_stop();
+	writer_stop();					//drains the queue before leaving
+	checkpointer_stop();
+	pool_mutex.lock();
+	db_uri = "file:";
+	db_gen++;
+	for ( auto r : reader_pool ) {	//owners reopen on their next query
+		r->mtx.lock();
+		reader_close(r);
+		r->mtx.unlock();
+	}
+	pool_mutex.unlock();
+	stmt_flush(write_cache);
 	sqlite3_close(db_write);
+	db_write = NULL;
 	return 0;
 }
-int sql_save(const char *fn)
+/*********************background backup**************************************/
+//copies SAVE_PAGES pages per step on its own connection and sleeps between
+//steps, so neither the UI nor the writer waits on it; a write to the source
+//restarts the copy, repeated restarts double the step until one step does it
+#define SAVE_PAGES	256
+#define SAVE_SLEEP	10
+static std::thread save_thread;
+static std::mutex save_mutex;
+static sqlite3 *save_src = NULL;			//for sqlite3_interrupt
+static std::string save_file, save_error;
+static int save_compact = false;
+static std::atomic<int> save_done(0), save_total(0), save_page_size(4096);
+static std::atomic<int> save_state(0);		//1 running, 0 done, -1 failed
+static std::atomic<bool> save_cancel(false);
+
+static void save_job(std::string uri, std::string fn, int compact)
 {
-	int rc = 0;
-	sqlite3 *bdb;
-	sqlite3_backup *pBackup;
-	if( sqlite3_open(fn, &bdb)==SQLITE_OK ) {
-		pBackup = sqlite3_backup_init(bdb, "main", db_read, "main");
-		if( pBackup ) {
-			sqlite3_backup_step(pBackup, -1);
-			rc = sqlite3_backup_pagecount(pBackup);
+	sqlite3 *src, *dst = NULL;
+	int rc = sqlite3_open_v2(uri.c_str(), &src, SQLITE_OPEN_READONLY|
+							SQLITE_OPEN_URI|SQLITE_OPEN_NOMUTEX, NULL);
+	save_mutex.lock();
+	save_src = src;
+	save_mutex.unlock();
+	if ( rc==SQLITE_OK && compact ) {	//vacuumed copy, progress by file size
+		sqlite3_stmt *res;
+		if ( sqlite3_prepare_v2(src, "select * from pragma_page_count, "
+						"pragma_page_size", -1, &res, NULL)==SQLITE_OK &&
+			sqlite3_step(res)==SQLITE_ROW ) {
+			save_total = sqlite3_column_int(res, 0);
+			save_page_size = sqlite3_column_int(res, 1);
+		}
+		sqlite3_finalize(res);
+		remove(fn.c_str());
+		char *sql = sqlite3_mprintf("VACUUM INTO %Q", fn.c_str());
+		rc = sqlite3_exec(src, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+	}
+	else if ( rc==SQLITE_OK &&
+				(rc=sqlite3_open(fn.c_str(), &dst))==SQLITE_OK ) {
+		sqlite3_backup *pBackup;
+		pBackup = sqlite3_backup_init(dst, "main", src, "main");
+		if ( pBackup==NULL )
+			rc = sqlite3_errcode(dst);
+		else {
+			int pages = SAVE_PAGES, last = -1;
+			do {
+				rc = sqlite3_backup_step(pBackup, pages);
+				int remaining = sqlite3_backup_remaining(pBackup);
+				save_total = sqlite3_backup_pagecount(pBackup);
+				save_done = save_total-remaining;
+				if ( last!=-1 && remaining>last ) pages *= 2;	//restarted
+				last = remaining;
+				if ( rc==SQLITE_OK || rc==SQLITE_BUSY || rc==SQLITE_LOCKED )
+					std::this_thread::sleep_for(
+								std::chrono::milliseconds(SAVE_SLEEP));
+			} while ( !save_cancel && (rc==SQLITE_OK ||
+							rc==SQLITE_BUSY || rc==SQLITE_LOCKED) );
 			sqlite3_backup_finish(pBackup);
 		}
-		sqlite3_close(bdb);
 	}
-	return rc;
+	if ( save_cancel )
+		save_error = "save cancelled";
+	else if ( rc!=SQLITE_DONE && !(compact && rc==SQLITE_OK) )
+		save_error = sqlite3_errmsg(dst!=NULL ? dst : src);
+	save_mutex.lock();
+	save_src = NULL;
+	save_mutex.unlock();
+	sqlite3_close(dst);
+	sqlite3_close(src);
+	if ( save_error.empty() ) {
+		save_done = save_total.load();
+		save_state = 0;
+	}
+	else {
+		remove(fn.c_str());			//no partial copies
+		save_state = -1;
+	}
+}
+//starts copying the database to fn in the background, compact writes a
+//vacuumed snapshot instead, returns false if a save is already running or
+//no database is open, see sql_errmsg()
+int sql_save(const char *fn, int compact)
+{
+	if ( db_write==NULL ) {
+		last_error = "database not open";
+		return false;
+	}
+	if ( save_state==1 ) {
+		last_error = "a save is already running";
+		return false;
+	}
+	if ( save_thread.joinable() ) save_thread.join();
+	pool_mutex.lock();
+	std::string uri = db_uri;
+	pool_mutex.unlock();
+	save_file = fn;
+	save_error.clear();
+	save_compact = compact;
+	save_done = save_total = 0;
+	save_cancel = false;
+	save_state = 1;
+	save_thread = std::thread(save_job, uri, save_file, compact);
+	return true;
+}
+//returns 1 while running, 0 when done, -1 if failed or cancelled; the
+//error is in sql_errmsg()
+int sql_save_progress(int *done, int *total)
+{
+	*done = save_done;
+	*total = save_total;
+	if ( save_state==1 && save_compact ) {
+		FILE *fp = fopen(save_file.c_str(), "rb");	//VACUUM INTO progress
+		if ( fp!=NULL ) {
+			fseek(fp, 0, SEEK_END);
+			*done = std::min((int)(ftell(fp)/save_page_size), *total);
+			fclose(fp);
+		}
+	}
+	int state = save_state;
+	if ( state!=1 && save_thread.joinable() ) save_thread.join();
+	if ( state==-1 ) last_error = save_error;
+	return state;
+}
+void sql_save_cancel()
+{
+	save_cancel = true;
+	save_mutex.lock();
+	if ( save_src!=NULL ) sqlite3_interrupt(save_src);
+	save_mutex.unlock();
+	if ( save_thread.joinable() ) save_thread.join();
+}
+/*********************bulk import********************************************/
+//the file is mapped copy on write and cut into IMPORT_CHUNK byte chunks at
+//line ends outside quotes. Parser threads split chunks into cells in place,
+//the import thread feeds them in file order to one sql_ingest template, in
+//batches of IMPORT_ROWS rows. One import runs at a time, its progress is
+//kept in the handle of the caller that started it
+#define IMPORT_CHUNK	(4<<20)
+#define IMPORT_ROWS		100000
+#define IMPORT_AHEAD	2			//chunks parsed ahead of the inserts, per parser
+struct import_chunk {
+	char *begin, *end;
+	std::vector<const char *> cells;
+	std::vector<int> lens;
+	std::vector<int> rows;			//number of cells of each row
+	int parsed;
+};
+struct import_task {
+	std::thread thread;
+	std::string error;
+	std::atomic<sqlite3_int64> rows;
+	std::atomic<int> done, total;	//chunks
+	std::atomic<int> state;			//1 running, 0 done, -1 failed
+	std::chrono::steady_clock::time_point start, end;
+};
+static std::mutex import_mutex;
+static std::condition_variable import_cv;
+static std::atomic<bool> import_cancel(false);
+static std::mutex import_owner_mutex;		//guards import_running
+static std::condition_variable import_owner_cv;
+static import_task *import_running = NULL;
+
+static char *import_map(const char *fn, size_t &size)
+{
+	char *data = NULL;
+	size = 0;
+#ifdef WIN32
+	HANDLE file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+							OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if ( file==INVALID_HANDLE_VALUE ) return NULL;
+	LARGE_INTEGER len;
+	if ( GetFileSizeEx(file, &len) && len.QuadPart>0 ) {
+		HANDLE map = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if ( map!=NULL ) {
+			data = (char *)MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+			if ( data!=NULL ) size = len.QuadPart;
+			CloseHandle(map);
+		}
+	}
+	CloseHandle(file);
+#else
+	int fd = open(fn, O_RDONLY);
+	if ( fd==-1 ) return NULL;
+	struct stat st;
+	if ( fstat(fd, &st)==0 && st.st_size>0 ) {
+		void *p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+																	fd, 0);
+		if ( p!=MAP_FAILED ) {
+			data = (char *)p;
+			size = st.st_size;
+			madvise(p, size, MADV_SEQUENTIAL);
+		}
+	}
+	close(fd);
+#endif
+	return data;
+}
+static void import_unmap(char *data, size_t size)
+{
+#ifdef WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+//splits the chunk into rows of cells, quoted csv cells are unquoted in place
+static void import_parse(import_chunk &c, char delim)
+{
+	char *p = c.begin, *end = c.end;
+	while ( p<end ) {
+		int n = 0;
+		for ( ;; ) {
+			char *s = p, *e;
+			if ( delim==',' && *p=='"' ) {	//"" is a quote, may span lines
+				e = s;
+				for ( p++; p<end; ) {
+					if ( *p=='"' ) {
+						if ( p+1<end && p[1]=='"' ) p++;
+						else { p++; break; }
+					}
+					*e++ = *p++;
+				}
+				while ( p<end && *p!=delim && *p!='\n' ) p++;
+			}
+			else {
+				while ( p<end && *p!=delim && *p!='\n' ) p++;
+				e = p;
+				if ( e>s && e[-1]=='\r' && (p==end || *p=='\n') ) e--;
+			}
+			c.cells.push_back(s);
+			c.lens.push_back(e-s);
+			n++;
+			if ( p<end && *p==delim ) { p++; continue; }
+			if ( p<end ) p++;
+			break;
+		}
+		if ( n==1 && c.lens.back()==0 ) {	//blank line
+			c.cells.pop_back();
+			c.lens.pop_back();
+		}
+		else
+			c.rows.push_back(n);
+	}
+	std::lock_guard<std::mutex> lck(import_mutex);
+	c.parsed = true;
+}
+static void import_parser(std::vector<import_chunk> *chunks, char delim,
+							std::atomic<size_t> *next, size_t *fed, size_t ahead)
+{
+	for ( ;; ) {
+		size_t i;
+		{
+			std::unique_lock<std::mutex> lck(import_mutex);
+			import_cv.wait(lck, [&]{ return import_cancel ||
+											*next<*fed+ahead; });
+			if ( import_cancel || *next>=chunks->size() ) return;
+			i = (*next)++;
+		}
+		import_parse((*chunks)[i], delim);
+		import_cv.notify_all();
+	}
+}
+//the end of the line starting at p, a csv quote only counts where it opens
+//a cell, "" inside a quoted cell is a quote and line ends in it are skipped.
+//Tab separated lines may be entered anywhere
+static char *import_line(char *p, char *end, char delim)
+{
+	if ( delim!=',' ) {
+		p = (char *)memchr(p, '\n', end-p);
+		return p!=NULL ? p+1 : end;
+	}
+	int quoted = false, start = true;
+	for ( ; p<end; p++ ) {
+		if ( quoted ) {
+			if ( *p=='"' ) {
+				if ( p+1<end && p[1]=='"' ) p++;
+				else quoted = false;
+			}
+			continue;
+		}
+		if ( *p=='\n' ) return p+1;
+		if ( *p=='"' && start ) quoted = true;
+		start = *p==delim;
+	}
+	return end;
+}
+//the task is its caller's once state is set, so it is set last
+static void import_finish(import_task *task, int state)
+{
+	task->end = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lck(import_owner_mutex);
+	import_running = NULL;
+	task->state = state;
+	import_owner_cv.notify_all();
+}
+static void import_job(import_task *task, std::string fn, std::string table)
+{
+	size_t size;
+	char *data = import_map(fn.c_str(), size);
+	if ( data==NULL ) {
+		task->error = "can't read " + fn;
+		import_finish(task, -1);
+		return;
+	}
+	char *p = data, *end = data+size;
+	if ( size>=3 && memcmp(p, "\xEF\xBB\xBF", 3)==0 ) p += 3;	//utf-8 BOM
+	char *eol = (char *)memchr(p, '\n', end-p);
+	char delim = memchr(p, '\t', (eol!=NULL ? eol : end)-p)!=NULL ? '\t' : ',';
+
+	import_chunk head = { p, import_line(p, end, delim) };
+	import_parse(head, delim);
+	int n = head.cells.size();
+	std::string names, marks;
+	for ( int i=0; i<n; i++ ) {
+		names += i ? ",\"" : "\"";
+		for ( int k=0; k<head.lens[i]; k++ )
+			names += head.cells[i][k]=='"' ? "\"\"" : std::string(1, head.cells[i][k]);
+		names += "\"";
+		marks += i ? ",?" : "?";
+	}
+	char *sql = sqlite3_mprintf("create table if not exists \"%w\" (%s)",
+										table.c_str(), names.c_str());
+	int id = -1;
+	if ( n>0 && sql_exec(sql, NULL, NULL) ) {
+		sqlite3_free(sql);
+		sql = sqlite3_mprintf("insert or replace into \"%w\" (%s) values (%s)",
+							table.c_str(), names.c_str(), marks.c_str());
+		id = sql_ingest_prepare(sql);
+	}
+	sqlite3_free(sql);
+	if ( id<0 ) {
+		task->error = n>0 ? last_error : "no column names in " + fn;
+		import_unmap(data, size);
+		import_finish(task, -1);
+		return;
+	}
+
+	//chunks end at the first line end after IMPORT_CHUNK bytes, csv is
+	//read line by line from the start, a line end may be inside a cell
+	p = head.end;
+	std::vector<import_chunk> chunks;
+	for ( char *b=p; b<end; ) {
+		char *e = b;
+		if ( delim==',' )
+			while ( e<end && e-b<IMPORT_CHUNK ) e = import_line(e, end, delim);
+		else if ( end-b>IMPORT_CHUNK )
+			e = import_line(b+IMPORT_CHUNK, end, delim);
+		else
+			e = end;
+		import_chunk c = { b, e };
+		chunks.push_back(c);
+		b = e;
+	}
+	task->total = chunks.size();
+
+	int parsers = std::max(1, (int)std::thread::hardware_concurrency()-1);
+	std::vector<std::thread> threads;
+	std::atomic<size_t> next(0);
+	size_t fed = 0;
+	for ( int t=0; t<parsers; t++ )
+		threads.emplace_back(import_parser, &chunks, delim, &next, &fed,
+												(size_t)parsers*IMPORT_AHEAD);
+	std::vector<const char *> cells(n);
+	std::vector<int> lens(n);
+	int ok = true, rows = 0;
+	void *batch = sql_batch();
+	for ( size_t i=0; i<chunks.size() && ok; i++ ) {
+		import_chunk &c = chunks[i];
+		{
+			std::unique_lock<std::mutex> lck(import_mutex);
+			import_cv.wait(lck, [&]{ return c.parsed || import_cancel; });
+		}
+		if ( import_cancel ) break;
+		size_t k = 0;
+		for ( int cnt : c.rows ) {
+			int m = std::min(cnt, n);
+			std::copy(c.cells.begin()+k, c.cells.begin()+k+m, cells.begin());
+			std::copy(c.lens.begin()+k, c.lens.begin()+k+m, lens.begin());
+			std::fill(lens.begin()+m, lens.end(), 0);	//missing cells are empty
+			k += cnt;
+			sql_batch_cells(batch, id, n, cells.data(), lens.data());
+			if ( ++rows==IMPORT_ROWS ) {
+				ok = sql_batch_commit(batch);
+				batch = sql_batch();
+				if ( ok ) task->rows += rows;
+				rows = 0;
+				if ( !ok ) break;
+			}
+		}
+		std::vector<const char *>().swap(c.cells);
+		std::vector<int>().swap(c.lens);
+		std::vector<int>().swap(c.rows);
+		{
+			std::lock_guard<std::mutex> lck(import_mutex);
+			fed = i+1;
+			task->done = fed;
+		}
+		import_cv.notify_all();
+	}
+	std::string err = ok ? "" : last_error;
+	int cancelled = import_cancel;
+	if ( ok && !cancelled ) {
+		ok = sql_batch_commit(batch);
+		if ( ok ) task->rows += rows;
+		else err = last_error;
+	}
+	else
+		delete (write_batch *)batch;		//rows of a cancelled batch dropped
+	{
+		std::lock_guard<std::mutex> lck(import_mutex);
+		import_cancel = true;				//parsers still ahead leave
+	}
+	import_cv.notify_all();
+	for ( auto &t : threads ) t.join();
+	import_unmap(data, size);
+	if ( !ok ) task->error = "import into " + table + " failed after " +
+						std::to_string(task->rows) + " rows committed, " + err;
+	if ( cancelled ) task->error = "import into " + table + " cancelled, " +
+						std::to_string(task->rows) + " rows committed";
+	import_finish(task, ok && !cancelled ? 0 : -1);
+}
+//loads a csv or tab separated file into table in the background, the first
+//line names the columns and creates the table if needed. Returns the
+//import's handle for sql_import_progress(), or NULL if an import is already
+//running, from this thread or another
+void *sql_import(const char *fn, const char *table)
+{
+	std::lock_guard<std::mutex> lck(import_owner_mutex);
+	if ( import_running!=NULL ) {
+		last_error = "a table import is already running";
+		return NULL;
+	}
+	import_task *task = new import_task;
+	task->rows = 0;
+	task->done = task->total = 0;
+	task->start = task->end = std::chrono::steady_clock::now();
+	task->state = 1;
+	import_cancel = false;
+	import_running = task;
+	task->thread = std::thread(import_job, task, std::string(fn),
+												std::string(table));
+	return task;
 }
+//returns 1 while running, 0 when done, -1 if failed or cancelled, with the
+//rows committed and the seconds taken so far; the error is in sql_errmsg().
+//The call that returns 0 or -1 frees imp
+int sql_import_progress(void *imp, sqlite3_int64 *rows, double *secs,
+						int *percent)
+{
+	import_task *task = (import_task *)imp;
+	int state = task->state;
+	auto stop = state==1 ? std::chrono::steady_clock::now() : task->end;
+	*rows = task->rows;
+	*secs = std::chrono::duration<double>(stop-task->start).count();
+	*percent = task->total>0 ? 100*task->done/task->total : 0;
+	if ( state!=1 ) {
+		if ( state==-1 ) last_error = task->error;
+		task->thread.join();
+		delete task;
+	}
+	return state;
+}
+//stops the running import, whoever started it, its caller is told -1
+void sql_import_cancel()
+{
+	std::unique_lock<std::mutex> lck(import_owner_mutex);
+	if ( import_running==NULL ) return;
+	{
+		std::lock_guard<std::mutex> lck2(import_mutex);
+		import_cancel = true;
+	}
+	import_cv.notify_all();
+	import_owner_cv.wait(lck, []{ return import_running==NULL; });
+}
+//runs on the writer thread, sql_cb is called there while the caller waits
 int sql_exec(const char *sql, sqlite3_callback sql_cb, void *data)
 {
-	return sqlite3_exec(db_write, sql, sql_cb, data, NULL)==SQLITE_OK;
+	if ( std::this_thread::get_id()==writer_thread.get_id() ) {
+		last_error.clear();			//called from inside a hook callback
+		return writer_run(sql, sql_cb, data, &last_error, false);
+	}
+	std::future<int> fut;
+	last_error.clear();
+	if ( !writer_post(sql, sql_cb, data, &fut, &last_error) ) {
+		last_error = "database not open";
+		return false;
+	}
+	return fut.get();
+}
+//values are SQL literals as quote() writes them, reals with all 17 digits,
+//bound to ?1 ?2 ... as the value they spell
+static void bind_literals(sqlite3_stmt *res, int n, const char *const *values)
+{
+	auto hex = [](char c) { return isdigit(c) ? c-'0' : (c|0x20)-'a'+10; };
+	for ( int i=0; i<n; i++ ) {
+		const char *v = values[i];
+		std::string s;
+		if ( *v=='\'' ) {
+			for ( v++; *v; v++ ) {
+				if ( *v=='\'' && *++v!='\'' ) break;	//'' is a quote
+				s += *v;
+			}
+			sqlite3_bind_text(res, i+1, s.data(), s.size(), SQLITE_TRANSIENT);
+		}
+		else if ( (*v=='X' || *v=='x') && v[1]=='\'' ) {
+			for ( v+=2; isxdigit(v[0]) && isxdigit(v[1]); v+=2 )
+				s += char(hex(v[0])*16+hex(v[1]));
+			sqlite3_bind_blob(res, i+1, s.data(), s.size(), SQLITE_TRANSIENT);
+		}
+		else if ( strcmp(v, "NULL")==0 )
+			sqlite3_bind_null(res, i+1);
+		else if ( strpbrk(v, ".eEI")!=NULL )		//Inf as printf writes it
+			sqlite3_bind_double(res, i+1, strtod(v, NULL));
+		else
+			sqlite3_bind_int64(res, i+1, strtoll(v, NULL, 10));
+	}
+}
+int sql_select(const char *sql, sqlite3_callback sql_cb, void *data)
+{
+	return sql_select_bound(sql, 0, NULL, sql_cb, data);
+}
+int sql_select_bound(const char *sql, int n, const char *const *values,
+						sqlite3_callback sql_cb, void *data)
+{
+	db_reader *r = reader_get();
+	sqlite3_stmt *res = stmt_get(r->cache, r->db, sql);
+	int rc = SQLITE_ERROR;
+	if ( res!=NULL ) {
+		bind_literals(res, n, values);
+		int c = sqlite3_column_count(res);
+		std::vector<char *> argv(c), names(c);
+		for ( int i=0; i<c; i++ )
+			names[i] = (char *)sqlite3_column_name(res, i);
+		while ( (rc=sqlite3_step(res))==SQLITE_ROW ) {
+			for ( int i=0; i<c; i++ )
+				argv[i] = (char *)sqlite3_column_text(res, i);
+			if ( sql_cb(data, c, argv.data(), names.data())!=0 ) {
+				rc = SQLITE_ABORT;
+				break;
+			}
+		}
+		stmt_put(r->cache, sql, res);
+	}
+	reader_put(r);
+	return rc==SQLITE_DONE;
 }
+//hook_cb is called on the writer thread for each row changed, once it is
+//committed, after the row counts are updated
 void *sql_hook(hook_callback hook_cb, void *data)
 {
-	return sqlite3_update_hook(db_write, hook_cb, data);
+	std::lock_guard<std::mutex> lck(hook_mutex);
+	void *old = user_hook_data;
+	user_hook = hook_cb;
+	user_hook_data = data;
+	return old;
 }
 int sql_queue(const char *fmt, ...)
 {
-	char buf[8192];
-	va_list args;
+	size_t pos;
+	write_slot *slot = writer_reserve(pos);
+	if ( slot==NULL ) return false;
+
+	va_list args, args2;
 	va_start(args, fmt);
-	vsnprintf(buf, 8192, (char *)fmt, args);
+	va_copy(args2, args);
+	int len = vsnprintf(slot->text, SLOT_TEXT, fmt, args);
+	if ( len>=SLOT_TEXT ) {				//rare, format again into the heap
+		slot->overflow.resize(len);
+		vsnprintf(&slot->overflow[0], len+1, fmt, args2);
+	}
+	va_end(args2);
 	va_end(args);
-	if ( *buf=='C' ) return sql_commit();
-
-	db_mutex.lock();
-	db_queue.push(std::string(buf));
-	db_mutex.unlock();
+	slot->tmpl = -1;
+	slot->cb = NULL;
+	slot->errmsg = NULL;
+	slot->done = NULL;
+	if ( *slot->sql()=='C' ) {			//commit, turn the slot into a barrier
+		std::future<int> fut;
+		writer_fill(slot, "", NULL, NULL, &fut, NULL);
+		writer_publish(slot, pos);
+		return fut.get();
+	}
+	writer_publish(slot, pos);
 	return true;
 }
+//waits until everything queued so far is committed
 int sql_commit( )
 {
-	int rc = false;
-	db_mutex.lock();
-	if ( !db_queue.empty() ) {;
-		sqlite3_exec(db_write, "BEGIN TRANSACTION", NULL, NULL, NULL);
-		while ( !db_queue.empty() ) {
-			std::string sql = db_queue.front();
-			rc = (sqlite3_exec(db_write,sql.c_str(),NULL,NULL,NULL)==SQLITE_OK);
-			log_print(rc?"+++":"---", sql.c_str(), sql.length());
-			db_queue.pop();
-		}
-		sqlite3_exec(db_write, "END TRANSACTION", NULL, NULL, NULL);
-	}
-	db_mutex.unlock();
-	return rc;
+	std::future<int> fut;
+	if ( !writer_post("", NULL, NULL, &fut, NULL) ) return false;
+	return fut.get();
 }
 int sql_row(char *sql)
 {
 	int len = 0;
-	sqlite3_stmt *res;
-	if( sqlite3_prepare_v2(db_read, sql, 1024, &res, NULL)==SQLITE_OK ) {
+	std::string key = sql;
+	db_reader *r = reader_get();
+	sqlite3_stmt *res = stmt_get(r->cache, r->db, key.c_str());
+	if( res!=NULL ) {
 		int c = sqlite3_column_count(res);
 		if ( sqlite3_step(res)==SQLITE_ROW ) {
 			for ( int i=0; i<c; i++ )
@@ -111,59 +2080,849 @@ int sql_row(char *sql)
 			sql[--len] = 0;
 		}
 	}
-	sqlite3_finalize(res);
+	stmt_put(r->cache, key.c_str(), res);
+	reader_put(r);
 	return len;
 }
+//streams the result as tab separated text in STREAM_CHUNK pieces, the first
+//row is flushed right away, a sink returning <0 cancels the query
+#define STREAM_CHUNK 65536
+struct stream_buf {
+	std::vector<char> buf;
+	int len = 0;
+	int cancelled = false;
+	sql_sink sink;
+	void *data;
+	stream_buf(sql_sink s, void *d, int size=STREAM_CHUNK) :
+										buf(size), sink(s), data(d) {}
+	void flush() {
+		if ( len>0 && !cancelled && sink(data, buf.data(), len)<0 )
+			cancelled = true;
+		len = 0;
+	}
+	void put(const char *p, int n) {
+		while ( n>0 && !cancelled ) {
+			int l = std::min(n, (int)buf.size()-len);
+			memcpy(buf.data()+len, p, l);
+			len += l; p += l; n -= l;
+			if ( len==(int)buf.size() ) flush();
+		}
+	}
+};
+int sql_file_sink(void *fp, const char *p, int n)	//sink to a FILE *
+{
+	return fwrite(p, 1, n, (FILE *)fp)==(size_t)n ? n : -1;
+}
+int sql_stream(const char *sql, sql_sink sink, void *data)
+{
+	db_reader *r = reader_get();
+	sqlite3_stmt *res = stmt_get(r->cache, r->db, sql);
+	if ( res==NULL ) {
+		last_error = sqlite3_errmsg(r->db);
+		reader_put(r);
+		return -1;
+	}
+
+	stream_buf out(sink, data);
+	int c = sqlite3_column_count(res);
+	for ( int i=0; i<c; i++ ) {
+		const char *name = sqlite3_column_name(res, i);
+		out.put(name, strlen(name));
+		if ( i<c-1 ) out.put("\t", 1);
+	}
+	int rc, rows = 0;
+	while ( !out.cancelled && (rc=sqlite3_step(res))==SQLITE_ROW ) {
+		out.put("\n", 1);
+		for ( int i=0; i<c; i++ ) {
+			const char *p = (const char *)sqlite3_column_text(res, i);
+			if ( p!=NULL ) out.put(p, sqlite3_column_bytes(res, i));
+			if ( i<c-1 ) out.put("\t", 1);
+		}
+		if ( ++rows==1 ) out.flush();
+	}
+	out.flush();
+	if ( !out.cancelled && rc!=SQLITE_DONE )
+		last_error = sqlite3_errmsg(r->db);
+	stmt_put(r->cache, sql, res);
+	reader_put(r);
+	return (out.cancelled || rc!=SQLITE_DONE) ? -1 : rows;
+}
+//binary columnar result, fixed size integers are little endian, varints
+//are LEB128 with 7 bits per byte, low bits first:
+//	"FLTB" u16 version=1, u16 columns, per column u16 length + name
+//	batches of up to BIN_BATCH rows: u32 rows, then per column
+//		u8 type, null bitmap of (rows+7)/8 bytes with bit set for null,
+//		and a value for every row that is not null:
+//		1 integer, zigzag varint of the difference to the previous value
+//		2 double, 8 bytes
+//		3 text and 4 blob, varint length + bytes
+//		5 text dictionary, varint entries, each varint length + bytes,
+//		  then a varint index per value
+//		0 all null, no values
+//	end: u32 0, or u32 0xffffffff, u16 length + error message
+//a column's type is picked per batch, integers widen to double, numbers
+//mixed with text or blobs are sent as their text, see doc/fltb.js for a
+//decoder
+#define BIN_BATCH 4096
+struct bin_cell {
+	int type;
+	union { sqlite3_int64 i; double f; };
+	size_t off;						//text and blob bytes in the arena
+	int len;
+};
+static void bin_u16(stream_buf &out, unsigned v)
+{
+	char b[2] = { (char)v, (char)(v>>8) };
+	out.put(b, 2);
+}
+static void bin_u32(stream_buf &out, uint32_t v)
+{
+	char b[4] = { (char)v, (char)(v>>8), (char)(v>>16), (char)(v>>24) };
+	out.put(b, 4);
+}
+static void bin_varint(stream_buf &out, uint64_t v)
+{
+	char b[10];
+	int n = 0;
+	do {
+		b[n] = v&0x7f;
+		v >>= 7;
+		if ( v ) b[n] |= 0x80;
+		n++;
+	} while ( v );
+	out.put(b, n);
+}
+static void bin_bytes(stream_buf &out, const char *p, int len)
+{
+	bin_varint(out, len);
+	out.put(p, len);
+}
+static void bin_batch(stream_buf &out, int c, int rows,
+						std::vector<bin_cell> &cells, std::string &arena)
+{
+	bin_u32(out, rows);
+	std::vector<char> nulls((rows+7)/8);
+	std::unordered_map<std::string, int> dict;
+	std::vector<int> index;
+	for ( int i=0; i<c; i++ ) {
+		int type = SQLITE_NULL;		//widest storage class in this column
+		for ( int r=0; r<rows; r++ ) {
+			int t = cells[r*c+i].type;
+			if ( t==SQLITE_NULL || t==type ) continue;
+			if ( type==SQLITE_NULL ) type = t;
+			else if ( t==SQLITE_BLOB || type==SQLITE_BLOB ) type = SQLITE_BLOB;
+			else if ( t==SQLITE_TEXT || type==SQLITE_TEXT ) type = SQLITE_TEXT;
+			else type = SQLITE_FLOAT;
+		}
+
+		char num[32];
+		std::vector<const char *> text(rows);	//text values, as sent
+		std::vector<int> len(rows);
+		dict.clear();
+		index.clear();
+		for ( int r=0; r<rows && (type==SQLITE_TEXT || type==SQLITE_BLOB);
+																	r++ ) {
+			bin_cell &cell = cells[r*c+i];
+			if ( cell.type==SQLITE_NULL ) continue;
+			if ( cell.type==SQLITE_INTEGER || cell.type==SQLITE_FLOAT ) {
+				if ( cell.type==SQLITE_INTEGER )
+					sqlite3_snprintf(32, num, "%lld", cell.i);
+				else
+					sqlite3_snprintf(32, num, "%!.15g", cell.f);
+				cell.type = SQLITE_TEXT;	//keep the digits in the arena
+				cell.off = arena.size();
+				cell.len = strlen(num);
+				arena.append(num, cell.len);
+			}
+			if ( type==SQLITE_BLOB ) continue;	//digits as the blob's bytes
+			auto ins = dict.insert(std::make_pair(
+						std::string(arena.data()+cell.off, cell.len),
+						(int)dict.size()));
+			index.push_back(ins.first->second);
+		}
+		int use_dict = type==SQLITE_TEXT && dict.size()*2<=index.size();
+
+		static const char tag[] = { 0, 1, 2, 3, 4, 0 };	//by SQLITE_ type
+		out.put(use_dict ? "\5" : tag+type, 1);
+		std::fill(nulls.begin(), nulls.end(), 0);
+		for ( int r=0; r<rows; r++ )
+			if ( cells[r*c+i].type==SQLITE_NULL ) nulls[r/8] |= 1<<(r%8);
+		out.put(nulls.data(), nulls.size());
+
+		if ( use_dict ) {
+			std::vector<const std::string *> entries(dict.size());
+			for ( auto &d : dict ) entries[d.second] = &d.first;
+			bin_varint(out, entries.size());
+			for ( auto e : entries ) bin_bytes(out, e->data(), e->size());
+			for ( int k : index ) bin_varint(out, k);
+			continue;
+		}
+		sqlite3_int64 prev = 0;
+		for ( int r=0; r<rows && type!=SQLITE_NULL; r++ ) {
+			bin_cell &cell = cells[r*c+i];
+			if ( cell.type==SQLITE_NULL ) continue;
+			union { double f; uint64_t u; } v;
+			uint64_t delta;
+			switch ( type ) {
+			case SQLITE_INTEGER:
+				delta = (uint64_t)cell.i-(uint64_t)prev;
+				bin_varint(out, (delta<<1)^(uint64_t)((int64_t)delta>>63));
+				prev = cell.i;
+				break;
+			case SQLITE_FLOAT:
+				v.f = cell.type==SQLITE_INTEGER ? (double)cell.i : cell.f;
+				bin_u32(out, (uint32_t)v.u);
+				bin_u32(out, (uint32_t)(v.u>>32));
+				break;
+			default:
+				bin_bytes(out, arena.data()+cell.off, cell.len);
+			}
+		}
+	}
+}
+int sql_stream_binary(const char *sql, sql_sink sink, void *data)
+{
+	db_reader *r = reader_get();
+	sqlite3_stmt *res = stmt_get(r->cache, r->db, sql);
+	if ( res==NULL ) {
+		last_error = sqlite3_errmsg(r->db);
+		reader_put(r);
+		return -1;
+	}
+
+	stream_buf out(sink, data);
+	int c = sqlite3_column_count(res);
+	out.put("FLTB", 4);
+	bin_u16(out, 1);
+	bin_u16(out, c);
+	for ( int i=0; i<c; i++ ) {
+		const char *name = sqlite3_column_name(res, i);
+		bin_u16(out, strlen(name));
+		out.put(name, strlen(name));
+	}
+	out.flush();
+
+	std::vector<bin_cell> cells(BIN_BATCH*c);
+	std::string arena;
+	int rc, rows = 0, n = 0;
+	while ( !out.cancelled && (rc=sqlite3_step(res))==SQLITE_ROW ) {
+		for ( int i=0; i<c; i++ ) {
+			bin_cell &cell = cells[n*c+i];
+			cell.type = sqlite3_column_type(res, i);
+			switch ( cell.type ) {
+			case SQLITE_INTEGER: cell.i = sqlite3_column_int64(res, i); break;
+			case SQLITE_FLOAT: cell.f = sqlite3_column_double(res, i); break;
+			case SQLITE_NULL: cell.i = 0; cell.len = 0; break;
+			default:
+				const char *p = cell.type==SQLITE_TEXT ?
+								(const char *)sqlite3_column_text(res, i) :
+								(const char *)sqlite3_column_blob(res, i);
+				cell.len = sqlite3_column_bytes(res, i);
+				cell.off = arena.size();
+				arena.append(p, cell.len);
+			}
+		}
+		rows++;
+		if ( ++n==BIN_BATCH ) {
+			bin_batch(out, c, n, cells, arena);
+			arena.clear();
+			n = 0;
+		}
+	}
+	if ( n>0 ) bin_batch(out, c, n, cells, arena);
+	if ( !out.cancelled && rc!=SQLITE_DONE ) {
+		last_error = sqlite3_errmsg(r->db);
+		bin_u32(out, 0xffffffff);
+		bin_u16(out, last_error.length());
+		out.put(last_error.c_str(), last_error.length());
+	}
+	else
+		bin_u32(out, 0);
+	out.flush();
+	stmt_put(r->cache, sql, res);
+	reader_put(r);
+	return (out.cancelled || rc!=SQLITE_DONE) ? -1 : rows;
+}
+//Apache Arrow IPC, the stream format, or the file format for exports, so
+//pyarrow and friends can map the result without parsing it. Each column's
+//type is picked from the first ARROW_BATCH rows as the widest storage class
+//seen: Int64, Float64, Utf8, or Binary, from the declared type when all are
+//null or a REAL column held only integers. A later value that doesn't fit,
+//text in Int64, 1.5 in Int64 or a blob in Utf8, fails the whole result
+//rather than be converted. Numbers fit Utf8 as their text.
+//Metadata is flatbuffers written front to back with offsets patched in,
+//numbers in host order, which Arrow requires to be little endian
+#define ARROW_BATCH		65536
+#define ARROW_BYTES		(1<<30)		//text in a batch, offsets are 32 bits
+enum { ARROW_INT64=2, ARROW_FLOAT64=3, ARROW_BINARY=4, ARROW_UTF8=5 };
+struct fb_buf {
+	std::string b;
+	void align(size_t a) { b.append((a-b.size()%a)%a, 0); }
+	size_t put(const void *p, size_t n) {
+		size_t at = b.size();
+		b.append((const char *)p, n);
+		return at;
+	}
+	size_t u32(uint32_t v) { return put(&v, 4); }
+	void link(size_t at, size_t to) {		//uoffset at "at" points to "to"
+		uint32_t v = to-at;
+		memcpy(&b[at], &v, 4);
+	}
+	//n fields of size[k] bytes, 0 to leave one out, an offset field is 4
+	//bytes and patched with link(at[k], ...) once its target is written
+	size_t table(int n, const int *size, const uint64_t *value, size_t *at) {
+		std::vector<uint16_t> vt(2+n, 0);
+		size_t len = 4;					//the vtable soffset
+		for ( int s=8; s>0; s/=2 )		//widest first, each stays aligned
+			for ( int k=0; k<n; k++ )
+				if ( size[k]==s ) { vt[2+k] = len; len += s; }
+		vt[0] = vt.size()*2;
+		vt[1] = len;
+		align(2);
+		size_t vtable = put(vt.data(), vt.size()*2);
+		while ( (b.size()+4)%8 ) b += '\0';
+		size_t pos = u32(0);
+		int32_t soff = pos-vtable;
+		memcpy(&b[pos], &soff, 4);
+		b.append(len-4, 0);
+		for ( int k=0; k<n; k++ )
+			if ( size[k]>0 ) {
+				at[k] = pos+vt[2+k];
+				memcpy(&b[at[k]], value+k, size[k]);	//little endian
+			}
+		return pos;
+	}
+	size_t vector(uint32_t n, size_t elem, size_t align8) {	//zeroed elements
+		align(4);
+		if ( align8 ) while ( (b.size()+4)%8 ) b += '\0';
+		size_t at = u32(n);
+		b.append(n*elem, 0);
+		return at;
+	}
+	size_t string(const char *s) {
+		align(4);
+		size_t at = u32(strlen(s));
+		b.append(s, strlen(s)+1);
+		return at;
+	}
+};
+struct arrow_col {
+	int type;
+	std::string valid, data;		//validity bitmap, values or bytes
+	std::vector<int32_t> offsets;	//of text and blob in data
+	int nulls;
+};
+static size_t arrow_schema(fb_buf &fb, sqlite3_stmt *res,
+							const std::vector<arrow_col> &cols)
+{
+	int size[] = { 0, 4 };				//endianness Little is the default
+	uint64_t value[] = { 0, 0 };
+	size_t at[2];
+	size_t schema = fb.table(2, size, value, at);
+	size_t fields = fb.vector(cols.size(), 4, false);
+	fb.link(at[1], fields);
+	for ( size_t i=0; i<cols.size(); i++ ) {
+		int fsize[] = { 4, 1, 1, 4, 0, 4 };	//name, nullable, type, children
+		uint64_t fvalue[] = { 0, 1, (uint64_t)cols[i].type, 0, 0, 0 };
+		size_t fat[6];
+		size_t field = fb.table(6, fsize, fvalue, fat);
+		fb.link(fields+4+4*i, field);
+		fb.link(fat[0], fb.string(sqlite3_column_name(res, i)));
+		size_t type;
+		if ( cols[i].type==ARROW_INT64 ) {
+			int tsize[] = { 4, 1 };			//bitWidth, is_signed
+			uint64_t tvalue[] = { 64, 1 };
+			size_t tat[2];
+			type = fb.table(2, tsize, tvalue, tat);
+		}
+		else if ( cols[i].type==ARROW_FLOAT64 ) {
+			int tsize[] = { 2 };			//precision DOUBLE
+			uint64_t tvalue[] = { 2 };
+			size_t tat[1];
+			type = fb.table(1, tsize, tvalue, tat);
+		}
+		else
+			type = fb.table(0, NULL, NULL, NULL);
+		fb.link(fat[3], type);
+		fb.link(fat[5], fb.vector(0, 4, false));
+	}
+	return schema;
+}
+//a Message of header type kind, 1 Schema or 3 RecordBatch, at the root
+static size_t arrow_message(fb_buf &fb, int kind, uint64_t body)
+{
+	fb.u32(0);
+	int size[] = { 2, 1, 4, 8 };		//version V5, header, bodyLength
+	uint64_t value[] = { 4, (uint64_t)kind, 0, body };
+	size_t at[4];
+	fb.link(0, fb.table(4, size, value, at));
+	return at[2];
+}
+//metadata padded to 8 bytes after the continuation marker and its length
+static void arrow_frame(stream_buf &out, fb_buf &fb, size_t &pos)
+{
+	fb.align(8);
+	uint32_t head[2] = { 0xffffffff, (uint32_t)fb.b.size() };
+	out.put((const char *)head, 8);
+	out.put(fb.b.data(), fb.b.size());
+	pos += 8+fb.b.size();
+}
+//false when the value's storage class doesn't fit the column's type
+static int arrow_cell(arrow_col &col, int r, sqlite3_stmt *res, int i,
+						sqlite3_value *v)	//v when the row was kept
+{
+	int t = v!=NULL ? sqlite3_value_type(v) : sqlite3_column_type(res, i);
+	if ( (col.type==ARROW_INT64 && t!=SQLITE_INTEGER && t!=SQLITE_NULL) ||
+		 (col.type==ARROW_FLOAT64 && (t==SQLITE_TEXT || t==SQLITE_BLOB)) ||
+		 (col.type==ARROW_UTF8 && t==SQLITE_BLOB) ) return false;
+	if ( r%8==0 ) col.valid += '\0';
+	if ( col.type==ARROW_UTF8 || col.type==ARROW_BINARY )
+		if ( r==0 ) col.offsets.assign(1, 0);
+	if ( t!=SQLITE_NULL ) col.valid.back() |= 1<<(r%8);
+	else col.nulls++;
+	switch ( col.type ) {
+	case ARROW_INT64: {
+		sqlite3_int64 x = t==SQLITE_NULL ? 0 : v!=NULL ?
+						sqlite3_value_int64(v) : sqlite3_column_int64(res, i);
+		col.data.append((const char *)&x, 8);
+		break;
+	}
+	case ARROW_FLOAT64: {
+		double x = t==SQLITE_NULL ? 0 : v!=NULL ?
+						sqlite3_value_double(v) : sqlite3_column_double(res, i);
+		col.data.append((const char *)&x, 8);
+		break;
+	}
+	default:
+		if ( t!=SQLITE_NULL ) {
+			const void *p;
+			if ( col.type==ARROW_UTF8 )
+				p = v!=NULL ? sqlite3_value_text(v) : sqlite3_column_text(res, i);
+			else
+				p = v!=NULL ? sqlite3_value_blob(v) : sqlite3_column_blob(res, i);
+			int n = v!=NULL ? sqlite3_value_bytes(v) : sqlite3_column_bytes(res, i);
+			if ( p!=NULL ) col.data.append((const char *)p, n);
+		}
+		col.offsets.push_back(col.data.size());
+	}
+	return true;
+}
+//declared types of the result columns, by name from pragma table_info of
+//the table a single table select reads, "" for the rest. The library is
+//built without sqlite3_column_decltype()
+static std::vector<std::string> arrow_decls(sqlite3_stmt *res)
+{
+	int c = sqlite3_column_count(res);
+	std::vector<std::string> decls(c);
+	const char *sql = sqlite3_sql(res);
+	const char *from = sql!=NULL ? strstr(sql, " from ") : NULL;
+	if ( from==NULL ) return decls;
+	const char *t = from+6, *e = t;
+	while ( isalnum((unsigned char)*e) || *e=='_' ) e++;
+	if ( e==t || *e==',' || strstr(e, " join ")!=NULL ) return decls;
+
+	std::string table(t, e-t);
+	char *pragma = sqlite3_mprintf("pragma table_info(\"%w\")", table.c_str());
+	sqlite3_stmt *info = NULL;
+	sqlite3_prepare_v2(sqlite3_db_handle(res), pragma, -1, &info, NULL);
+	sqlite3_free(pragma);
+	while ( info!=NULL && sqlite3_step(info)==SQLITE_ROW ) {
+		const char *name = (const char *)sqlite3_column_text(info, 1);
+		const char *type = (const char *)sqlite3_column_text(info, 2);
+		for ( int i=0; i<c && name!=NULL; i++ )
+			if ( sqlite3_stricmp(sqlite3_column_name(res, i), name)==0 )
+				decls[i] = type!=NULL ? type : "";
+	}
+	sqlite3_finalize(info);
+	return decls;
+}
+//the Arrow type of a column with no values to go by, as SQLite picks a
+//column's affinity from its declared type
+static int arrow_decltype(const std::string &decl, int type)
+{
+	std::string d = decl;
+	for ( auto &ch : d ) ch = toupper((unsigned char)ch);
+	int real = d.find("INT")==std::string::npos &&
+			   (d.find("REAL")!=std::string::npos ||
+				d.find("FLOA")!=std::string::npos ||
+				d.find("DOUB")!=std::string::npos);
+	if ( type==SQLITE_INTEGER ) return real ? ARROW_FLOAT64 : ARROW_INT64;
+	if ( type==SQLITE_FLOAT ) return ARROW_FLOAT64;
+	if ( type==SQLITE_TEXT ) return ARROW_UTF8;
+	if ( type==SQLITE_BLOB ) return ARROW_BINARY;
+	if ( d.find("INT")!=std::string::npos ) return ARROW_INT64;
+	if ( real ) return ARROW_FLOAT64;
+	if ( d.find("BLOB")!=std::string::npos ) return ARROW_BINARY;
+	return ARROW_UTF8;
+}
+static const char *arrow_type_name(int type)
+{
+	return type==ARROW_INT64 ? "Int64" : type==ARROW_FLOAT64 ? "Float64" :
+		   type==ARROW_BINARY ? "Binary" : "Utf8";
+}
+struct arrow_block { sqlite3_int64 offset; int32_t meta, pad; sqlite3_int64 body; };
+static void arrow_batch(stream_buf &out, std::vector<arrow_col> &cols, int rows,
+						size_t &pos, std::vector<arrow_block> &blocks)
+{
+	std::vector<std::pair<const char *, size_t>> bufs;
+	for ( auto &col : cols ) {
+		if ( col.offsets.empty() ) col.offsets.assign(1, 0);	//no rows
+		bufs.push_back(std::make_pair(col.valid.data(),
+									col.nulls>0 ? col.valid.size() : 0));
+		if ( col.type==ARROW_UTF8 || col.type==ARROW_BINARY )
+			bufs.push_back(std::make_pair((const char *)col.offsets.data(),
+												col.offsets.size()*4));
+		bufs.push_back(std::make_pair(col.data.data(), col.data.size()));
+	}
+	uint64_t body = 0;
+	for ( auto &b : bufs ) body += (b.second+7)/8*8;
+
+	fb_buf fb;
+	size_t header = arrow_message(fb, 3, body);
+	int size[] = { 8, 4, 4 };			//length, nodes, buffers
+	uint64_t value[] = { (uint64_t)rows, 0, 0 };
+	size_t at[3];
+	fb.link(header, fb.table(3, size, value, at));
+	size_t nodes = fb.vector(cols.size(), 16, true);
+	fb.link(at[1], nodes);
+	for ( size_t i=0; i<cols.size(); i++ ) {
+		sqlite3_int64 node[2] = { rows, cols[i].nulls };
+		memcpy(&fb.b[nodes+4+16*i], node, 16);
+	}
+	size_t buffers = fb.vector(bufs.size(), 16, true);
+	fb.link(at[2], buffers);
+	sqlite3_int64 off = 0;
+	for ( size_t i=0; i<bufs.size(); i++ ) {
+		sqlite3_int64 buf[2] = { off, (sqlite3_int64)bufs[i].second };
+		memcpy(&fb.b[buffers+4+16*i], buf, 16);
+		off += (bufs[i].second+7)/8*8;
+	}
+
+	arrow_block block = { (sqlite3_int64)pos, 0, 0, (sqlite3_int64)body };
+	arrow_frame(out, fb, pos);
+	block.meta = pos-block.offset;
+	blocks.push_back(block);
+	static const char zeros[8] = { 0 };
+	for ( auto &b : bufs ) {
+		out.put(b.first, b.second);
+		out.put(zeros, (8-b.second%8)%8);
+	}
+	pos += body;
+	for ( auto &col : cols ) {
+		col.valid.clear();
+		col.data.clear();
+		col.offsets.clear();
+		col.nulls = 0;
+	}
+}
+//writes the result of res to out, file adds the magic and the footer that
+//indexes the batches, rows counts the rows written when not NULL; returns
+//-1 with the error in last_error, unless cancelled
+static int arrow_write(stream_buf &out, sqlite3_stmt *res, int file,
+						std::atomic<int> *rows)
+{
+	int c = sqlite3_column_count(res);
+	std::vector<arrow_col> cols(c);
+	std::vector<sqlite3_value *> kept;	//the first batch, to pick the types
+	int rc, n = 0, total = 0;
+	while ( (rc=sqlite3_step(res))==SQLITE_ROW && n<ARROW_BATCH ) {
+		for ( int i=0; i<c; i++ )
+			kept.push_back(sqlite3_value_dup(sqlite3_column_value(res, i)));
+		n++;
+	}
+	std::vector<std::string> decls = arrow_decls(res);
+	for ( int i=0; i<c; i++ ) {
+		int type = SQLITE_NULL;			//as bin_batch() widens them
+		for ( int r=0; r<n; r++ ) {
+			int t = sqlite3_value_type(kept[r*c+i]);
+			if ( t==SQLITE_NULL || t==type ) continue;
+			if ( type==SQLITE_NULL ) type = t;
+			else if ( t==SQLITE_BLOB || type==SQLITE_BLOB ) type = SQLITE_BLOB;
+			else if ( t==SQLITE_TEXT || type==SQLITE_TEXT ) type = SQLITE_TEXT;
+			else type = SQLITE_FLOAT;
+		}
+		cols[i].type = arrow_decltype(decls[i], type);
+		cols[i].nulls = 0;
+	}
+
+	size_t pos = 0;
+	std::vector<arrow_block> blocks;
+	if ( file ) {
+		out.put("ARROW1\0\0", 8);
+		pos = 8;
+	}
+	fb_buf fb;
+	size_t header = arrow_message(fb, 1, 0);
+	fb.link(header, arrow_schema(fb, res, cols));
+	arrow_frame(out, fb, pos);
+
+	for ( int r=0; r<n; r++ )
+		for ( int i=0; i<c; i++ ) {
+			arrow_cell(cols[i], r, res, i, kept[r*c+i]);
+			sqlite3_value_free(kept[r*c+i]);
+		}
+	if ( rc==SQLITE_ROW ) {				//the row after the first batch
+		arrow_batch(out, cols, n, pos, blocks);
+		total = n;
+		if ( rows!=NULL ) *rows += n;
+		n = 0;
+		do {
+			size_t bytes = 0;
+			for ( int i=0; i<c; i++ ) {
+				if ( !arrow_cell(cols[i], n, res, i, NULL) ) {
+					static const char *names[] = { "", "integer", "real",
+												   "text", "blob" };
+					char *msg = sqlite3_mprintf("row %d: %s in %s column %s, "
+									"typed by the first %d rows", total+n+1,
+									names[sqlite3_column_type(res, i)],
+									arrow_type_name(cols[i].type),
+									sqlite3_column_name(res, i), ARROW_BATCH);
+					last_error = msg;
+					sqlite3_free(msg);
+					return -1;
+				}
+				bytes += cols[i].data.size();
+			}
+			if ( ++n==ARROW_BATCH || bytes>=ARROW_BYTES ) {
+				arrow_batch(out, cols, n, pos, blocks);
+				total += n;
+				if ( rows!=NULL ) *rows += n;
+				n = 0;
+			}
+		} while ( !out.cancelled && (rc=sqlite3_step(res))==SQLITE_ROW );
+	}
+	if ( n>0 || blocks.empty() ) {
+		arrow_batch(out, cols, n, pos, blocks);
+		total += n;
+		if ( rows!=NULL ) *rows += n;
+	}
+	if ( out.cancelled ) return -1;
+	if ( rc!=SQLITE_DONE ) {
+		last_error = sqlite3_errmsg(sqlite3_db_handle(res));
+		return -1;
+	}
+
+	uint32_t eos[2] = { 0xffffffff, 0 };
+	out.put((const char *)eos, 8);
+	if ( file ) {
+		fb_buf foot;
+		foot.u32(0);
+		int size[] = { 2, 4, 0, 4 };	//version, schema, recordBatches
+		uint64_t value[] = { 4, 0, 0, 0 };
+		size_t at[4];
+		foot.link(0, foot.table(4, size, value, at));
+		size_t vec = foot.vector(blocks.size(), 24, true);
+		foot.link(at[3], vec);
+		for ( size_t i=0; i<blocks.size(); i++ )
+			memcpy(&foot.b[vec+4+24*i], &blocks[i], 24);
+		foot.link(at[1], arrow_schema(foot, res, cols));
+		uint32_t len = foot.b.size();
+		out.put(foot.b.data(), len);
+		out.put((const char *)&len, 4);
+		out.put("ARROW1", 6);
+	}
+	return total;
+}
+int sql_stream_arrow(const char *sql, sql_sink sink, void *data)
+{
+	db_reader *r = reader_get();
+	sqlite3_stmt *res = stmt_get(r->cache, r->db, sql);
+	if ( res==NULL ) {
+		last_error = sqlite3_errmsg(r->db);
+		reader_put(r);
+		return -1;
+	}
+	stream_buf out(sink, data);
+	int rows = arrow_write(out, res, false, NULL);
+	out.flush();
+	stmt_put(r->cache, sql, res);
+	reader_put(r);
+	return rows;
+}
+struct reply_buf {
+	char *buf;
+	size_t len, size;
+};
+static int reply_sink(void *data, const char *p, int n)
+{
+	reply_buf *reply = (reply_buf *)data;
+	if ( reply->len+n+1>reply->size ) {
+		size_t size = reply->size==0 ? 8192 : reply->size;
+		while ( reply->len+n+1>size ) size *= 2;
+		char *buf2 = (char *)realloc(reply->buf, size);
+		if ( buf2==NULL ) return -1;
+		reply->buf = buf2;
+		reply->size = size;
+	}
+	memcpy(reply->buf+reply->len, p, n);
+	reply->len += n;
+	return n;
+}
 int sql_table(const char *sql, char **preply)
 {
 	*preply = NULL;
 	if ( strncmp(sql, "select ", 7)!=0 ) {
-		if (sqlite3_exec(db_write, sql, NULL, NULL, NULL)!=SQLITE_OK) {
-			*preply = strdup(sqlite3_errmsg(db_write));
+		if ( !sql_exec(sql, NULL, NULL) ) {
+			*preply = strdup(last_error.c_str());
 			if ( *preply!=NULL )
 				return strlen(*preply);
 		}
 		return 0;
 	}
 
-	sqlite3_stmt *res;
-	if ( sqlite3_prepare_v2(db_read, sql, 1024, &res, NULL)!=SQLITE_OK ) {
-		*preply = strdup(sqlite3_errmsg(db_read));
+	reply_buf reply = { NULL, 0, 0 };
+	if ( sql_stream(sql, reply_sink, &reply)<0 && reply.len==0 ) {
+		*preply = strdup(last_error.c_str());
 		if ( *preply!=NULL )
 			return strlen(*preply);
 		else
 			return 0;
 	}
+	if ( reply.len>0 ) {
+		reply.buf[reply.len] = 0;
+		*preply = reply.buf;
+	}
+	return reply.len;
+}
+const char *sql_errmsg()			//of the last sql_exec on this thread
+{
+	return last_error.c_str();
+}
+/*********************csv export*********************************************/
+//runs the query on its own reader and writes every row to the file through
+//an EXPORT_BUFFER byte buffer, cells are quoted as in RFC 4180, or as an
+//Arrow IPC file when the name ends in .arrow
+#define EXPORT_BUFFER	(1<<20)
+static std::thread export_thread;
+static std::mutex export_mutex;
+static sqlite3 *export_db = NULL;			//for sqlite3_interrupt
+static std::string export_file, export_error;
+static int export_arrow = false;			//Arrow IPC file instead of csv
+static std::atomic<int> export_rows(0);
+static std::atomic<int> export_state(0);	//1 running, 0 done, -1 failed
+static std::atomic<bool> export_cancel(false);
 
-	size_t size = 8192, len = 0;
-	char *buf = (char *)malloc(size);
-	int c = sqlite3_column_count(res);
-	for ( int i=0; i<c; i++ )
-		len += sprintf(buf+len, "%s\t", sqlite3_column_name(res, i));
-
-	while ( sqlite3_step(res)==SQLITE_ROW ) {
-		len += sprintf(buf+len-1, "\n")-1;
+static int export_sink(void *data, const char *p, int n)
+{
+	if ( export_cancel ) return -1;
+	return sql_file_sink(data, p, n);
+}
+static void csv_put(stream_buf &out, const char *p, int n)
+{
+	int quote = n>0 && (p[0]==' ' || p[n-1]==' ');
+	for ( int i=0; i<n && !quote; i++ )
+		quote = p[i]==',' || p[i]=='"' || p[i]=='\n' || p[i]=='\r';
+	if ( !quote ) {
+		out.put(p, n);
+		return;
+	}
+	out.put("\"", 1);
+	for ( const char *q; (q=(const char *)memchr(p, '"', n))!=NULL; ) {
+		out.put(p, q-p+1);
+		out.put("\"", 1);				//"" for a quote
+		n -= q-p+1;
+		p = q+1;
+	}
+	out.put(p, n);
+	out.put("\"", 1);
+}
+static void export_job(std::string sql, FILE *fp)
+{
+	db_reader *r = reader_get();
+	export_mutex.lock();
+	export_db = r->db;
+	export_mutex.unlock();
+	int rc = SQLITE_ERROR, failed = false;
+	sqlite3_stmt *res = export_cancel ? NULL :
+						stmt_get(r->cache, r->db, sql.c_str());
+	if ( res!=NULL && export_arrow ) {
+		stream_buf out(export_sink, fp, EXPORT_BUFFER);
+		if ( arrow_write(out, res, true, &export_rows)>=0 ) rc = SQLITE_DONE;
+		out.flush();
+		failed = out.cancelled;
+		stmt_put(r->cache, sql.c_str(), res);
+	}
+	else if ( res!=NULL ) {
+		stream_buf out(export_sink, fp, EXPORT_BUFFER);
+		int c = sqlite3_column_count(res);
 		for ( int i=0; i<c; i++ ) {
-			char *p = (char *)sqlite3_column_text(res, i);
-			if ( p==NULL ) p=(char *)"";
-			if ( len+strlen(p)+2>size ) {
-				size*=2;
-				char *buf2 = (char *)realloc(buf, size);
-				if ( buf2==NULL ) goto done_select;
-				buf = buf2;
+			const char *name = sqlite3_column_name(res, i);
+			csv_put(out, name, strlen(name));
+			out.put(i<c-1 ? "," : "\r\n", i<c-1 ? 1 : 2);
+		}
+		while ( !out.cancelled && (rc=sqlite3_step(res))==SQLITE_ROW ) {
+			for ( int i=0; i<c; i++ ) {
+				const char *p = (const char *)sqlite3_column_text(res, i);
+				if ( p!=NULL ) csv_put(out, p, sqlite3_column_bytes(res, i));
+				out.put(i<c-1 ? "," : "\r\n", i<c-1 ? 1 : 2);
 			}
-			len+=sprintf(buf+len, "%s\t", p);
+			export_rows++;
 		}
+		out.flush();
+		failed = out.cancelled;
+		stmt_put(r->cache, sql.c_str(), res);
 	}
-done_select:
-	sqlite3_finalize(res);
-	if ( len>0 ) {
-		buf[--len]=0;
-		*preply = buf;
+	if ( export_cancel )
+		export_error = "export cancelled";
+	else if ( failed )
+		export_error = "can't write " + export_file;
+	else if ( rc!=SQLITE_DONE )
+		export_error = res!=NULL && export_arrow ? last_error :
+												sqlite3_errmsg(r->db);
+	export_mutex.lock();
+	export_db = NULL;
+	export_mutex.unlock();
+	reader_put(r);
+	if ( fclose(fp)!=0 && rc==SQLITE_DONE ) {
+		export_error = "can't write " + export_file;
+		failed = true;
+	}
+	if ( rc==SQLITE_DONE && !failed && !export_cancel )
+		export_state = 0;
+	else {
+		remove(export_file.c_str());	//no partial exports
+		export_state = -1;
 	}
-	return len;
 }
-const char *sql_errmsg()
+//starts writing the result of sql to fn as csv in the background, returns
+//false if an export is running or fn can't be created, see sql_errmsg()
+int sql_export(const char *sql, const char *fn)
 {
-	return sqlite3_errmsg(db_write);
-}
\ No newline at end of file
+	if ( export_state==1 ) {
+		last_error = "an export is already running";
+		return false;
+	}
+	if ( export_thread.joinable() ) export_thread.join();
+	FILE *fp = fopen(fn, "wb");
+	if ( fp==NULL ) {
+		last_error = std::string("can't create ") + fn;
+		return false;
+	}
+	export_file = fn;
+	size_t l = export_file.size();
+	export_arrow = l>6 && sqlite3_stricmp(fn+l-6, ".arrow")==0;
+	export_error.clear();
+	export_rows = 0;
+	export_cancel = false;
+	export_state = 1;
+	export_thread = std::thread(export_job, std::string(sql), fp);
+	return true;
+}
+//returns 1 while running, 0 when done, -1 if failed or cancelled, with the
+//rows written so far; the error is in sql_errmsg()
+int sql_export_progress(int *rows)
+{
+	int state = export_state;
+	if ( state!=1 && export_thread.joinable() ) export_thread.join();
+	*rows = export_rows;
+	if ( state==-1 ) last_error = export_error;
+	return state;
+}
+void sql_export_cancel()
+{
+	export_cancel = true;
+	export_mutex.lock();
+	if ( export_db!=NULL ) sqlite3_interrupt(export_db);
+	export_mutex.unlock();
+	if ( export_thread.joinable() ) export_thread.join();
+}
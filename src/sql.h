@@ -15,6 +15,7 @@
 //     https://github.com/zoudaokou/flTable/issues/new
 //
 #include <sqlite3.h>
+#include <future>
 typedef int (*sqlite3_callback)(
    void *,    /* Data provided in the 4th argument of sqlite3_exec() */
    int,       /* The number of columns in row */
@@ -28,13 +29,49 @@ typedef  void(*hook_callback)(
     char const *,   //table name
     sqlite3_int64   //rowid
 );
-int sql_open(const char *fn);
-int sql_save(const char *fn);
+typedef int (*sql_sink)(
+    void *,         // Data provided in the 3rd argument of sql_stream
+    const char *,   //next chunk of the result
+    int             //length of the chunk, return <0 to cancel the query
+);
+int sql_open(const char *fn, const char *profile=NULL);
+int sql_save(const char *fn, int compact=false);
+int sql_save_progress(int *done, int *total);
+void sql_save_cancel();
+void *sql_import(const char *fn, const char *table);
+int sql_import_progress(void *imp, sqlite3_int64 *rows, double *secs,
+						int *percent);
+void sql_import_cancel();
+int sql_export(const char *sql, const char *fn);
+int sql_export_progress(int *rows);
+void sql_export_cancel();
 int sql_close();
 int sql_exec( const char *sql, sqlite3_callback sql_cb, void *data );
+int sql_select( const char *sql, sqlite3_callback sql_cb, void *data );
+int sql_select_bound(const char *sql, int n, const char *const *values,
+						sqlite3_callback sql_cb, void *data);
 void * sql_hook(hook_callback hook_cb, void *data);
 int sql_queue(const char *fmt, ...);
+std::future<int> sql_async(const char *sql);
+int sql_ingest_prepare(const char *sql);
+int sql_ingest(int id, const char *types, ...);
+int sql_ingest_cells(int id, int n, const char *const *cells, const int *lens);
+void *sql_batch();
+int sql_batch_ingest(void *b, int id, const char *types, ...);
+int sql_batch_cells(void *b, int id, int n, const char *const *cells,
+					const int *lens);
+int sql_batch_commit(void *b);
 int sql_commit();
 int sql_row(char *sql);
+int sql_count(const char *table, const char *where, int *rows);
+unsigned sql_version();
+void *sql_reader();
+void sql_interrupt(void *reader);
 int sql_table(const char *sql, char **preply);
+int sql_stream(const char *sql, sql_sink sink, void *data);
+int sql_file_sink(void *fp, const char *p, int n);
+int sql_stream_binary(const char *sql, sql_sink sink, void *data);
+int sql_stream_arrow(const char *sql, sql_sink sink, void *data);
+void sql_cache_stats(int *hits, int *misses);
+int sql_stats(char **preply);
 const char *sql_errmsg();
\ No newline at end of file
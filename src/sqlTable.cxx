@@ -21,6 +21,8 @@
 #include <FL/fl_draw.H>
 #include <FL/Fl_Menu.H>
 #include "sqlTable.h"
+#include <future>
+#include <algorithm>
 
 typedef int (*sqlite3_callback)(
    void*,    /* Data provided in the 4th argument of sqlite3_exec()*/
@@ -29,21 +31,37 @@ typedef int (*sqlite3_callback)(
    char**    /* An array of strings representing column names */
 );
 int sql_exec( const char *sql, sqlite3_callback sql_cb, void *data);
+int sql_select( const char *sql, sqlite3_callback sql_cb, void *data);
+int sql_select_bound(const char *sql, int n, const char *const *values,
+						sqlite3_callback sql_cb, void *data);
+std::future<int> sql_async(const char *sql);
 int sql_table(const char *sql, char **preply);
+int sql_stream(const char *sql, int (*sink)(void *, const char *, int),
+				void *data);
 int sql_row(char *sql);
+int sql_count(const char *table, const char *where, int *rows);
+int sql_queue(const char *fmt, ...);
+int sql_ingest_prepare(const char *sql);
+int sql_ingest(int id, const char *types, ...);
+int sql_ingest_cells(int id, int n, const char *const *cells, const int *lens);
+void *sql_batch();
+int sql_batch_ingest(void *b, int id, const char *types, ...);
+int sql_batch_cells(void *b, int id, int n, const char *const *cells,
+					const int *lens);
+int sql_batch_commit(void *b);
+int sql_export(const char *sql, const char *fn);
+const char *sql_errmsg();
+unsigned sql_version();
+void *sql_reader();
+void sql_interrupt(void *reader);
+#ifndef SQLITE_UPDATE
+#define SQLITE_UPDATE	23		//update hook operation, as in sqlite3.h
+#endif
 
-static int sql_callback(void *data, int argc, char **argv, char **col_names)
-{
-	sqlTable *pTable = (sqlTable *)data;
-	pTable->insert(argc, argv, col_names);
-	return 0;
-}
 void sqlTable::add_col( const char *hdr )
 {
 	header.push_back(std::string(hdr));
 	int i = header.size()-1;
-	if ( strcmp(hdr,"cleared" )==0 ) clearCol = i;
-	if ( strcmp(hdr,"severity")==0 ) severityCol = i;
 	{// Initialize column width to header width
 		int w=0, h=0;
 		fl_font(HEADER_FONTFACE, HEADER_FONTSIZE);
@@ -51,33 +69,220 @@ void sqlTable::add_col( const char *hdr )
 		col_width(i, w+24);
 	}
 }
-void sqlTable::insert( int argc, char **argv, char **col_names )
+void row_store::add(const char *const *argv, int n)
 {
-	if ( headerChanged ) {
-		headerChanged = false;
-		header.clear();
-		for ( int i=0; i<argc; i++ )
-			add_col(col_names[i]);
-		cols(argc);
+	spans.push_back(span{(unsigned)cells.size(), (unsigned)n});
+	for ( int i=0; i<n; i++ ) {
+		cells.push_back(text.size());
+		const char *s = argv[i]==NULL ? "" : argv[i];
+		text.append(s, strlen(s)+1);
 	}
-
-	Row newrow;
-	newrow.clear();
+}
+void row_store::add(const row_store &from, size_t r)
+{
+	int n = from.cols(r);
+	spans.push_back(span{(unsigned)cells.size(), (unsigned)n});
+	for ( int i=0; i<n; i++ ) {
+		cells.push_back(text.size());
+		const char *s = from.cell(r, i);
+		text.append(s, strlen(s)+1);
+	}
+}
+void row_store::set(size_t r, int c, const char *s)	//the old text stays
+{
+	cells[spans[r].cell+c] = text.size();
+	text.append(s, strlen(s)+1);
+}
+void row_store::replace(size_t r, const row_store &from, size_t k)
+{										//rebuilt, set() would leave the old text
+	row_store t;
+	for ( size_t i=0; i<size(); i++ )
+		if ( i==r ) t.add(from, k); else t.add(*this, i);
+	text.swap(t.text);
+	cells.swap(t.cells);
+	spans.swap(t.spans);
+}
+int row_store::same(size_t r, const row_store &o, size_t k) const
+{
+	if ( cols(r)!=o.cols(k) ) return false;
+	for ( int i=0; i<cols(r); i++ )
+		if ( strcmp(cell(r, i), o.cell(k, i))!=0 ) return false;
+	return true;
+}
+Row row_store::row(size_t r) const
+{
+	Row row;
+	for ( int i=0; i<cols(r); i++ ) row.push_back(cell(r, i));
+	return row;
+}
+//pixel width of a cell, memoized as the same values repeat, severity,
+//node names, on every refresh
+int sqlTable::text_width(const char *s)
+{
+	widthKey.assign(s);
+	std::unordered_map<std::string, int>::iterator it =
+													textWidths.find(widthKey);
+	if ( it!=textWidths.end() ) return it->second;
+	if ( textWidths.size()>=TEXT_WIDTHS ) textWidths.clear();
+	int w=0, h=0;
 	fl_font(ROW_FONTFACE, ROW_FONTSIZE);
-	for ( int i=0; i<argc; i++ ) {
-		const char *rowtext = argv[i]==NULL?"":argv[i];
-		newrow.push_back(std::string(rowtext));
-		int w=0, h=0;		//measure and set column width
-		fl_measure(rowtext, w, h, 0);
-		w += 24; if ( w>600 ) w=600;
+	fl_measure(s, w, h, 0);
+	return textWidths[widthKey] = w;
+}
+void sqlTable::col_widths(const row_store &rows, size_t r)	//widen to fit
+{
+	for ( int i=0; i<rows.cols(r); i++ ) {
+		int w = text_width(rows.cell(r, i))+24;
+		if ( w>600 ) w=600;
 		if ( w>col_width(i) ) col_width(i, w);
 	}
-	_rowdata.insert(_rowdata.begin(), newrow);
+}
+/*********************cell styles*********************************************/
+//rules are evaluated once per row as it is read, into a style byte that
+//draw_cell() looks up, style 0 is plain
+static const char *default_styles[] = {	//alarms not cleared, by severity
+	"severity gray when severity='warning' and cleared=''",
+	"severity lightblue when severity='minor' and cleared=''",
+	"severity yellow when severity='major' and cleared=''",
+	"severity red when severity='critical' and cleared=''",
+};
+static int style_color(const char *name, Fl_Color *color)
+{
+	const struct { const char *name; Fl_Color color; } colors[] = {
+		{ "white", FL_WHITE }, { "gray", FL_DARK1 }, { "yellow", FL_YELLOW },
+		{ "lightblue", fl_lighter(FL_BLUE) }, { "blue", FL_BLUE },
+		{ "red", FL_RED }, { "green", FL_GREEN }, { "cyan", FL_CYAN },
+		{ "magenta", FL_MAGENTA } };
+	for ( auto &c : colors )
+		if ( strcmp(name, c.name)==0 ) { *color = c.color; return true; }
+	unsigned rgb;
+	if ( name[0]=='#' && strlen(name)==7 && sscanf(name+1, "%x", &rgb)==1 ) {
+		*color = fl_rgb_color(rgb>>16, (rgb>>8)&0xff, rgb&0xff);
+		return true;
+	}
+	return false;
+}
+static int style_match(const style_cond &c, const char *s)
+{
+	char *end;
+	double v = c.numeric ? strtod(s, &end) : 0;
+	int cmp = c.numeric && end!=s && *end==0 ? (v>c.num)-(v<c.num) :
+											strcmp(s, c.text.c_str());
+	switch ( c.op ) {
+		case '=': return cmp==0;
+		case '!': return cmp!=0;
+		case '<': return cmp<0;
+		case '>': return cmp>0;
+		case 'l': return cmp<=0;
+		case 'g': return cmp>=0;
+	}
+	return false;
+}
+//"<column|*> <color> when <column> <op> <value> [and ...]", "clear" drops
+//all rules, "default" goes back to the alarm colours
+int sqlTable::style(const char *spec)
+{
+	if ( strcmp(spec, "clear")==0 || strcmp(spec, "default")==0 ) {
+		rules.clear();
+		if ( spec[0]=='d' )
+			for ( const char *d : default_styles ) style(d);
+	}
+	else {
+		style_rule rule;
+		char target[64], color[32];
+		int n = 0;
+		if ( sscanf(spec, " %63[A-Za-z0-9_*] %31[A-Za-z0-9#] when %n",
+					target, color, &n)<2 || n==0 ) return false;
+		if ( !style_color(color, &rule.color) ) return false;
+		rule.target = target;
+		const char *p = spec+n;
+		while ( true ) {
+			style_cond c;
+			char col[64], op[3];
+			if ( sscanf(p, " %63[A-Za-z0-9_] %2[=!<>] %n", col, op, &n)<2 )
+				return false;
+			p += n;
+			const char *ops[] = { "=", "!=", "<>", "<", ">", "<=", ">=" };
+			int k = 0;
+			while ( k<7 && strcmp(op, ops[k])!=0 ) k++;
+			if ( k==7 ) return false;
+			c.op = "=!!<>lg"[k];
+			c.col = col;
+			if ( *p=='\'' ) {
+				const char *q = strchr(++p, '\'');
+				if ( q==NULL ) return false;
+				c.text.assign(p, q-p);
+				p = q+1;
+			}
+			else {
+				n = strcspn(p, " ");
+				c.text.assign(p, n);
+				p += n;
+			}
+			char *end;
+			c.num = strtod(c.text.c_str(), &end);
+			c.numeric = !c.text.empty() && *end==0;
+			rule.conds.push_back(c);
+			p += strspn(p, " ");
+			if ( *p==0 ) break;
+			if ( strncmp(p, "and ", 4)!=0 ) return false;
+			p += 4;
+		}
+		if ( rules.size()>=STYLE_RULES ) return false;
+		rules.push_back(rule);
+	}
+	styleGen++;
+	topRow = -1;
+	redraw();
+	return true;
+}
+void sqlTable::style_compile()			//rule columns to header positions
+{
+	for ( auto &rule : rules ) {
+		std::vector<std::string>::iterator it =
+						std::find(header.begin(), header.end(), rule.target);
+		rule.index = rule.target=="*" ? -1 : it-header.begin();
+		rule.active = rule.target=="*" || it!=header.end();
+		for ( auto &c : rule.conds ) {
+			it = std::find(header.begin(), header.end(), c.col);
+			c.index = it-header.begin();
+			if ( it==header.end() ) rule.active = false;
+		}
+	}
+	styleIds.clear();
+	styleColors.assign(1, std::vector<Fl_Color>(header.size(), FL_WHITE));
+	compiledGen = styleGen;
+}
+unsigned char sqlTable::style_of(const row_store &rows, size_t r)
+{
+	unsigned long long mask = 0;
+	for ( size_t i=0; i<rules.size(); i++ ) {
+		if ( !rules[i].active ) continue;
+		int match = true;
+		for ( auto &c : rules[i].conds )
+			match = match && c.index<rows.cols(r) &&
+							 style_match(c, rows.cell(r, c.index));
+		if ( match ) mask |= 1ULL<<i;
+	}
+	if ( mask==0 ) return 0;
+	std::unordered_map<unsigned long long, unsigned char>::iterator it =
+															styleIds.find(mask);
+	if ( it!=styleIds.end() ) return it->second;
+	if ( styleColors.size()>255 ) return 0;	//out of styles, plain
+	std::vector<Fl_Color> colors(header.size(), FL_WHITE);
+	for ( size_t i=0; i<rules.size(); i++ ) {
+		if ( (mask&(1ULL<<i))==0 ) continue;
+		if ( rules[i].index<0 )
+			colors.assign(header.size(), rules[i].color);
+		else
+			colors[rules[i].index] = rules[i].color;
+	}
+	styleColors.push_back(colors);
+	return styleIds[mask] = styleColors.size()-1;
 }
 
 sqlTable::sqlTable(int x,int y,int w,int h,const char *l):Fl_Table(x,y,w,h,l)
 {
-	for ( int i=0; i<MAXCOLS; i++ ) sort[i]=0;
 	col_header(1);
 	col_resize(1);
 	col_header_height(24);
@@ -91,14 +296,50 @@ sqlTable::sqlTable(int x,int y,int w,int h,const char *l):Fl_Table(x,y,w,h,l)
 	editing = false;
 	edit_input = NULL;
 	edit_row = edit_col = -1;
-	severityCol = clearCol = -1;
+	keyset = countExact = false;
+	pageClock = pageGen = widthGen = 0;
+	styleGen = 1;
+	compiledGen = 0;
+	style("default");
+	lastFirst = scrollDir = -1;
+	leftCol = rightCol = -1;
+	_rowpartial = false;
+	loading = loadShown = cancelled = false;
+	pasteDone = pasteTotal = pasteState = 0;
+	reader = NULL;
+	loadJob = prefetchJob = patchJob = running = NULL;
+	stopping = changed = changedMoved = patching = false;
+	version = sql_version();
+	refreshGap = REFRESH_MIN;
+	refreshed = std::chrono::steady_clock::now();
+	Fl::add_timeout(REFRESH_POLL, poll_timer, this);
 	rows(0); cols(0);
 	viewRows = h/24-2;
+	worker = std::thread(work, this);
 
 	select_sql = "select * from ";
 	select_sql += l;
 	select(select_sql.c_str());
 }
+sqlTable::~sqlTable()
+{
+	Fl::remove_timeout(count_timer, this);
+	Fl::remove_timeout(load_timer, this);
+	Fl::remove_timeout(refresh_timer, this);
+	Fl::remove_timeout(poll_timer, this);
+	Fl::remove_timeout(paste_timer, this);
+	if ( paster.joinable() ) paster.join();
+	pageMutex.lock();
+	stopping = true;
+	if ( running!=NULL ) sql_interrupt(reader);
+	pageMutex.unlock();
+	pageCv.notify_all();
+	worker.join();
+	delete loadJob;
+	delete prefetchJob;
+	delete patchJob;
+	for ( auto job : done ) delete job;
+}
 void sqlTable::select(const char *cmd)
 {
 	std::string sql = cmd;
@@ -110,10 +351,731 @@ void sqlTable::select(const char *cmd)
 		std::size_t j = select_sql.find(" ", i);
 		if ( j==std::string::npos ) j = select_sql.length();
 		copy_label(select_sql.substr(i, j-i).c_str());
+		pageMutex.lock();
+		hookTable = label();
+		pageMutex.unlock();
 		headerChanged = dataChanged = true;
+		cancelled = false;
+		keyset_parse();
+		redraw();
+	}
+	sort.assign(sort.size(), 0);	//clear sort arrows 8/22/2019
+}
+//page by seeking on the sort key plus rowid instead of a growing offset,
+//only for "select <columns> from <table> [where ..] [order by <columns>]"
+void sqlTable::keyset_parse()
+{
+	keyset = false;
+	pages_clear();
+	query.cols.clear();
+	query.desc.clear();
+	query.fields.clear();
+	query.star = false;
+
+	std::size_t f = select_sql.find(" from ");
+	if ( select_sql.compare(0, 7, "select ")!=0 || f==std::string::npos ) return;
+	std::string columns = select_sql.substr(7, f-7);
+	if ( columns.find('(')!=std::string::npos ) return;	//aggregates
+	if ( columns.compare(0, 9, "distinct ")==0 ) return;
+
+	std::size_t t = f+6, e = t;
+	while ( e<select_sql.size() && (isalnum(select_sql[e]) || select_sql[e]=='_') )
+		e++;
+	if ( e==t ) return;
+	query.table = select_sql.substr(f, e-f);
+
+	std::size_t o = select_sql.find(" order by ");
+	std::string rest = select_sql.substr(e, o==std::string::npos ?
+										std::string::npos : o-e);
+	if ( rest.compare(0, 7, " where ")==0 )
+		query.where = rest.substr(7);
+	else if ( rest.empty() )
+		query.where = "";
+	else
+		return;						//join, group by, limit ...
+	const char *unseekable[] = { " group by ", " having ", " limit ",
+								 " union ", " intersect ", " except " };
+	for ( const char *u : unseekable )
+		if ( query.where.find(u)!=std::string::npos ) return;
+
+	int desc = false;
+	if ( o!=std::string::npos ) {
+		std::string terms = select_sql.substr(o+10) + ",";
+		std::size_t p = 0, q;
+		while ( (q=terms.find(',', p))!=std::string::npos ) {
+			char name[64], dir[8], more;
+			int n = sscanf(terms.substr(p, q-p).c_str(),
+						" %63[A-Za-z0-9_] %7s %c", name, dir, &more);
+			p = q+1;
+			if ( n==2 && (strcmp(dir, "DESC")==0 || strcmp(dir, "desc")==0) )
+				desc = true;
+			else if ( n==2 && (strcmp(dir, "ASC")==0 || strcmp(dir, "asc")==0) )
+				desc = false;
+			else if ( n!=1 )
+				return;				//expressions, collations ...
+			else
+				desc = false;
+			if ( strcmp(name, "rowid")==0 ) break;
+			query.cols.push_back(name);
+			query.desc.push_back(desc);
+		}
+	}
+	query.cols.push_back("rowid");	//ties broken by rowid, in index order
+	query.desc.push_back(desc);
+
+	query.keys = "";
+	for ( size_t i=0; i<query.cols.size()-1; i++ )
+		query.keys += "," + key_query::key_expr(query.cols[i]);
+	query.keys += ",rowid";
+	query.select = "select " + columns + query.keys;
+	keyset = true;
+
+	query.star = columns=="*";			//for reading some columns only
+	if ( query.star && !headerChanged )
+		query.star_names(header);
+	else if ( !query.star && columns.find_first_of("'\"`[*")==std::string::npos ) {
+		std::size_t p = 0, q;
+		columns += ",";
+		while ( (q=columns.find(',', p))!=std::string::npos ) {
+			query.fields.push_back(columns.substr(p, q-p));
+			p = q+1;
+		}
+	}
+}
+void key_query::star_names(const Row &names)	//"select *" as columns
+{
+	fields.clear();
+	for ( auto &name : names ) {
+		std::string f = "\"";
+		for ( char c : name ) f += c=='"' ? "\"\"" : std::string(1, c);
+		fields.push_back(f + "\"");
+	}
+}
+//the key column as an SQL literal, quote() keeps only 15 digits of a real
+std::string key_query::key_expr(const std::string &col)
+{
+	return "case when typeof(" + col + ")='real' then printf('%!.17g'," +
+			col + ") else quote(" + col + ") end";
+}
+//rows after key in query order, or before it when reverse. The rows after
+//a key are split into ranges that each seek one index position: equal on
+//the leading key columns and after the key on the next, deepest first,
+//NULL sorts first so it is a range of its own at the end when descending,
+//the key's values are bound to ?1 ?2 ...
+std::string key_query::sql(const Row *key, int reverse, int limit, int offset) const
+{
+	std::string filter = where.empty() ? "" : "("+where+") and ";
+	std::string order;
+	for ( size_t i=0; i<cols.size(); i++ ) {
+		order += i==0 ? " order by " : ",";
+		order += cols[i];
+		if ( desc[i]^reverse ) order += " DESC";
+	}
+	char limits[64];
+	sprintf(limits, " limit %d offset %d", limit, offset);
+	if ( key==NULL ) {
+		filter = where.empty() ? "" : " where "+where;
+		return select + table + filter + order + limits;
+	}
+
+	std::vector<std::string> ranges;
+	for ( int i=cols.size()-1; i>=0; i-- ) {
+		std::string same;
+		for ( int j=0; j<i; j++ )
+			same += cols[j] + " is ?" + std::to_string(j+1) + " and ";
+		const std::string &k = cols[i], p = "?" + std::to_string(i+1);
+		int null = (*key)[i]=="NULL";
+		if ( !(desc[i]^reverse) )
+			ranges.push_back(same + k + (null ? " is not null" : ">"+p));
+		else if ( !null ) {
+			ranges.push_back(same + k + "<" + p);
+			ranges.push_back(same + k + " is null");
+		}
+	}
+	if ( ranges.size()==1 )
+		return select + table + " where " + filter + ranges[0] +
+				order + limits;
+
+	std::string sql;
+	sprintf(limits, " limit %d)", limit+offset);
+	for ( size_t i=0; i<ranges.size(); i++ ) {
+		if ( i>0 ) sql += " union all ";
+		sql += "select * from (" + select + table + " where " +
+				filter + ranges[i] + order + limits;
+	}
+	sprintf(limits, " limit %d offset %d", limit, offset);
+	return sql + limits;
+}
+//rows read by seeking, in query order, sort key columns split off
+static int page_callback(void *data, int argc, char **argv, char **col_names)
+{
+	page_job *job = (page_job *)data;
+	int n = argc-job->query.cols.size();
+	if ( job->names.empty() ) job->names.assign(col_names, col_names+n);
+	if ( job->cols.empty() )
+		job->rows.add(argv, n);
+	else {								//a cell for each column, "" if not read
+		job->argv.assign(job->width, NULL);
+		for ( int i=0; i<n; i++ ) job->argv[job->cols[i]] = argv[i];
+		job->rows.add(job->argv.data(), job->width);
+	}
+	job->keys.add(argv+n, argc-n);
+	return 0;
+}
+static int page_select(const std::string &sql, page_job &job)	//job.key bound
+{
+	std::vector<const char *> values;
+	for ( auto &v : job.key ) values.push_back(v.c_str());
+	return sql_select_bound(sql.c_str(), values.size(), values.data(),
+							page_callback, &job);
+}
+//runs on the worker, a reverse read that comes back short is read again
+//from the start, the count is off and its rows can't be placed
+static int page_fetch(page_job &job)
+{
+	if ( job.query.cols.empty() ) {	//paged by offset, placed by the count
+		if ( !job.count.empty() ) {
+			char sql[1024];
+			strncpy(sql, job.count.c_str(), 1023);
+			sql[1023] = 0;
+			if ( sql_row(sql) ) job.total = atoi(sql);
+			if ( job.cancelled ) return job.ok = false;
+			if ( job.total>=0 )
+				job.first = std::max(0, job.total-job.limit-job.top);
+		}
+		std::string sql = job.select + " limit " + std::to_string(job.limit) +
+							" offset " + std::to_string(job.first);
+		return job.ok = sql_select(sql.c_str(), page_callback, &job);
+	}
+	if ( job.patch )				//the rows changed, by rowid
+		return job.ok = sql_select(job.select.c_str(), page_callback, &job);
+	std::string sql = job.query.sql(job.key.empty() ? NULL : &job.key,
+									job.reverse, job.limit, job.offset);
+	job.ok = page_select(sql, job);
+	if ( job.ok && job.reverse && (int)job.rows.size()!=job.limit &&
+		 !job.cancelled ) {
+		job.rows.clear();
+		job.keys.clear();
+		job.key.clear();
+		job.reverse = false;
+		job.offset = job.first;
+		return page_fetch(job);
+	}
+	if ( job.reverse ) {
+		job.rows.reverse();
+		job.keys.reverse();
+	}
+	return job.ok;
+}
+//rows first..first+n from the nearest cached row, or from either end
+void sqlTable::page_anchor(page_job &job, int first, int n)
+{
+	int P = viewRows, cost = first;
+	const row_store *keys = NULL;	//the key is row at of keys
+	int at = 0;
+	job.reverse = false;
+	if ( totalRows-first-n<=cost ) {	//a tie reads the end, count unknown
+		cost = totalRows-first-n;
+		job.reverse = true;
+	}
+	std::map<int, row_page>::iterator it = pages.lower_bound(first/P);
+	if ( it!=pages.end() && it->first==first/P && first%P>0 &&
+		 (int)it->second.keys.size()>=first%P ) {	//row first-1 is cached
+		keys = &it->second.keys;
+		at = first%P-1;
+		cost = 0;
+		job.reverse = false;
+	}
+	else if ( it!=pages.begin() ) {
+		std::map<int, row_page>::iterator lo = std::prev(it);
+		int last = lo->first*P+lo->second.keys.size()-1;
+		if ( !lo->second.keys.empty() && first-last-1<cost ) {
+			keys = &lo->second.keys;
+			at = lo->second.keys.size()-1;
+			cost = first-last-1;
+			job.reverse = false;
+		}
+	}
+	for ( it=pages.lower_bound((first+n)/P); it!=pages.end(); it++ ) {
+		int row = std::max(it->first*P, first+n);	//first cached row after
+		if ( row-it->first*P>=(int)it->second.keys.size() ) continue;
+		if ( row-first-n<cost ) {
+			keys = &it->second.keys;
+			at = row-it->first*P;
+			cost = row-first-n;
+			job.reverse = true;
+		}
+		break;
+	}
+	job.key = keys!=NULL ? keys->row(at) : Row();
+	job.limit = n;
+	job.offset = cost;
+	job.first = first;
+	job.query = query;
+}
+int sqlTable::page_ready(int page)		//with the columns needed
+{
+	std::map<int, row_page>::iterator it = pages.find(page);
+	if ( it==pages.end() || (int)it->second.rows.size()<
+							std::min(viewRows, totalRows-page*viewRows) )
+		return false;
+	const std::vector<char> &fetched = it->second.fetched;
+	for ( int c : needCols )
+		if ( !fetched.empty() && (c>=(int)fetched.size() || !fetched[c]) )
+			return false;
+	return true;
+}
+//columns to read: those shown and margin each side, and those the sort
+//key and cell styles need. Empty for all, until the header is in
+void sqlTable::cols_wanted(std::vector<int> &want, int margin)
+{
+	want.clear();
+	int n = header.size();
+	if ( !keyset || headerChanged || (int)query.fields.size()!=n ) return;
+	int r1, r2, c1, c2;
+	visible_cells(r1, r2, c1, c2);
+	for ( int c=std::max(0, c1-margin); c<=std::min(n-1, c2+margin); c++ )
+		want.push_back(c);
+	for ( auto &rule : rules )
+		for ( auto &c : rule.conds )
+			if ( rule.active ) want.push_back(c.index);
+	for ( size_t i=0; i+1<query.cols.size(); i++ ) {
+		int c = std::find(header.begin(), header.end(), query.cols[i])-
+															header.begin();
+		if ( c<n ) want.push_back(c);
+	}
+	std::sort(want.begin(), want.end());
+	want.erase(std::unique(want.begin(), want.end()), want.end());
+	if ( (int)want.size()==n ) want.clear();
+}
+void sqlTable::project(page_job &job)
+{
+	cols_wanted(job.cols, COL_MARGIN);
+	job.width = header.size();
+	if ( job.cols.empty() ) return;
+	job.query.select = "select ";
+	for ( size_t i=0; i<job.cols.size(); i++ )
+		job.query.select += (i>0 ? "," : "") + query.fields[job.cols[i]];
+	job.query.select += query.keys;
+}
+int sqlTable::page_find(const char *rowid, int &page, int &r)
+{
+	for ( auto &p : pages )
+		for ( size_t k=0; k<p.second.keys.size(); k++ )
+			if ( strcmp(p.second.keys.cell(k, p.second.keys.cols(k)-1),
+						rowid)==0 ) {
+				page = p.first;
+				r = k;
+				return true;
+			}
+	return false;
+}
+row_page &sqlTable::page_add(int page)	//emptied, its buffers are kept
+{
+	row_page &p = pages[page];
+	p.rows.clear();
+	p.keys.clear();
+	p.used = ++pageClock;
+	p.measured = p.styled = -1;
+	while ( pages.size()>2*PREFETCH_PAGES+4 ) {	//least recently used
+		std::map<int, row_page>::iterator old = pages.begin();
+		for ( auto it=pages.begin(); it!=pages.end(); it++ )
+			if ( it->second.used<old->second.used ) old = it;
+		pages.erase(old);
+	}
+	return p;
+}
+void sqlTable::pages_add(page_job *job)	//split into pages of viewRows
+{
+	int P = viewRows;
+	for ( size_t i=0; i<job->rows.size(); i+=P ) {
+		row_page &p = page_add((job->first+i)/P);
+		p.fetched.clear();
+		if ( !job->cols.empty() ) p.fetched.assign(job->width, false);
+		for ( int c : job->cols ) p.fetched[c] = true;
+		for ( size_t r=i; r<std::min(i+P, job->rows.size()); r++ ) {
+			p.rows.add(job->rows, r);
+			p.keys.add(job->keys, r);
+		}
+	}
+}
+//a newer view load replaces the one queued and stops the one running,
+//unless it reads the same rows, e.g. on the once a second refresh
+void sqlTable::load_post(page_job *job)
+{
+	std::lock_guard<std::mutex> lck(pageMutex);
+	page_job *last = loadJob!=NULL ? loadJob : running;
+	if ( last!=NULL && !last->cancelled && last->same(*job) ) {
+		delete job;
+		return;
+	}
+	delete loadJob;
+	loadJob = job;
+	if ( running!=NULL && !running->patch ) {	//a few rows by rowid
+		running->cancelled = true;
+		sql_interrupt(reader);
+	}
+	loading = true;
+	pageCv.notify_one();
+	if ( !Fl::has_timeout(load_timer, this) )
+		Fl::add_timeout(LOAD_DELAY, load_timer, this);
+}
+//the view is in, shown right away when paged by offset, else cached. When
+//verifying, a page that reads back different was changed by another
+//process, drop all pages then
+void sqlTable::load_merge(page_job *job)
+{
+	if ( job->cancelled ) return;		//a newer load follows, or Escape
+	if ( headerChanged && !job->names.empty() ) {
+		headerChanged = false;
+		header.clear();
+		for ( size_t i=0; i<job->names.size(); i++ )
+			add_col(job->names[i].c_str());
+		cols(job->names.size());
+		sort.resize(header.size(), 0);
+		if ( query.star ) query.star_names(header);
+		widthGen++;						//pages are measured and styled again
+		styleGen++;
+	}
+	if ( job->query.cols.empty() ) {
+		if ( job->total>=0 ) {
+			totalRows = job->total;
+			rows(totalRows);
+		}
+		Fl::lock();						//_rowdata[0] is the last query row
+		_rowids.clear();
+		_rowpartial = false;
+		_rowdata.clear();
+		for ( size_t r=job->rows.size(); r-->0; ) _rowdata.add(job->rows, r);
+		if ( compiledGen!=styleGen ) style_compile();
+		_rowstyle.clear();
+		for ( size_t r=0; r<_rowdata.size(); r++ )
+			_rowstyle.push_back(style_of(_rowdata, r));
+		Fl::unlock();
+		for ( size_t r=0; r<_rowdata.size(); r++ ) col_widths(_rowdata, r);
+		return;
+	}
+	if ( !job->ok ) {
+		keyset = false;					//e.g. sort on an alias, page by offset
+		pages_clear();
+		dataChanged = true;
+		return;
+	}
+	if ( job->page!=viewRows ) {		//resized meanwhile
+		dataChanged = true;
+		return;
+	}
+	if ( job->gen!=pageGen ) dataChanged = true;	//changed while reading
+	for ( size_t i=0; job->verify && i<job->rows.size(); i+=viewRows ) {
+		std::map<int, row_page>::iterator it =
+								pages.find((job->first+i)/viewRows);
+		if ( it==pages.end() ) continue;
+		const std::vector<char> &f = it->second.fetched;	//other columns
+		int cols = std::count(f.begin(), f.end(), true)==(int)job->cols.size();
+		for ( int c : job->cols ) cols = cols && c<(int)f.size() && f[c];
+		if ( !cols ) continue;
+		size_t n = std::min(job->rows.size()-i, (size_t)viewRows);
+		int differ = it->second.rows.size()!=n;
+		for ( size_t r=0; !differ && r<n; r++ )
+			differ = !it->second.rows.same(r, job->rows, i+r);
+		if ( differ ) {
+			pages_clear();
+			break;
+		}
+	}
+	pages_add(job);
+	topRow = -1;						//show them
+}
+void sqlTable::pages_merge()			//results of the worker
+{
+	std::vector<page_job *> jobs;
+	pageMutex.lock();
+	jobs.swap(done);
+	int idle = loadJob==NULL && (running==NULL || !running->load);
+	pageMutex.unlock();
+	for ( auto job : jobs ) {
+		if ( job->verify || job->patch )	//refreshes use a fifth at most
+			refreshGap = std::min(REFRESH_MAX,
+							std::max(REFRESH_MIN, REFRESH_LOAD*job->took));
+		if ( job->load )
+			load_merge(job);
+		else if ( job->patch )
+			patch_merge(job);
+		else if ( job->ok && job->gen==pageGen && job->page==viewRows )
+			pages_add(job);
+		delete job;
+	}
+	if ( loading && idle ) {
+		loading = loadShown = false;
+		Fl::remove_timeout(load_timer, this);
+	}
+}
+//queue the missing pages next to the view, scroll direction first
+void sqlTable::pages_prefetch(int first, int n)
+{
+	std::lock_guard<std::mutex> lck(pageMutex);
+	if ( loadJob!=NULL || prefetchJob!=NULL || patchJob!=NULL ||
+		 running!=NULL || n<=0 )
+		return;
+	int P = viewRows, last = (totalRows-1)/P;
+	for ( int dir : { scrollDir, -scrollDir } ) {
+		int pg = (dir<0 ? first : first+n-1)/P, k;
+		for ( k=1; k<=PREFETCH_PAGES && page_ready(pg+dir*k); k++ );
+		int start = pg+dir*k, run = 0;
+		while ( k+run<=PREFETCH_PAGES && start+dir*run>=0 &&
+				start+dir*run<=last && !page_ready(start+dir*run) ) run++;
+		if ( run==0 ) continue;
+
+		const row_page &from = pages[start-dir];	//cached, next to start
+		if ( from.keys.empty() ) return;
+		page_job *job = new page_job;
+		job->query = query;
+		job->key = from.keys.row(dir>0 ? from.keys.size()-1 : 0);
+		job->reverse = dir<0;
+		job->first = dir>0 ? start*P : (start-run+1)*P;
+		job->limit = dir>0 ? std::min(run*P, totalRows-start*P) : run*P;
+		job->offset = 0;
+		job->gen = pageGen;
+		job->page = P;
+		project(*job);
+		prefetchJob = job;
+		pageCv.notify_one();
+		return;
+	}
+}
+//runs the view loads, then patches, then the read ahead, on its own
+//reader connection
+void sqlTable::work(sqlTable *t)
+{
+	std::unique_lock<std::mutex> lck(t->pageMutex);
+	t->reader = sql_reader();
+	while ( true ) {
+		t->pageCv.wait(lck, [t]{ return t->stopping || t->loadJob!=NULL ||
+								t->patchJob!=NULL || t->prefetchJob!=NULL; });
+		if ( t->stopping ) break;
+		page_job **next = t->loadJob!=NULL ? &t->loadJob :
+						  t->patchJob!=NULL ? &t->patchJob : &t->prefetchJob;
+		page_job *job = *next;
+		*next = NULL;
+		t->running = job;
+		lck.unlock();
+		auto start = std::chrono::steady_clock::now();
+		page_fetch(*job);
+		job->took = std::chrono::duration<double>(
+						std::chrono::steady_clock::now()-start).count();
+		lck.lock();
+		t->running = NULL;
+		t->done.push_back(job);
+		if ( job->load ) Fl::awake(t);	//redrawn by the main loop
+		if ( job->patch ) Fl::awake(patch_ready, t);
+	}
+}
+void sqlTable::load_cancel()			//Escape, the rows shown stay
+{
+	pageMutex.lock();
+	delete loadJob;
+	loadJob = NULL;
+	if ( running!=NULL && running->load ) {
+		running->cancelled = true;
+		sql_interrupt(reader);
+	}
+	pageMutex.unlock();
+	loading = loadShown = false;
+	cancelled = true;
+	Fl::remove_timeout(load_timer, this);
+	redraw();
+}
+//called on the writer thread by the update hook, once committed. In
+//rowid order a change moves only the rows after it, any change can move
+//rows of a sorted query, updates alone move none
+void sqlTable::row_changed(int type, const char *table, long long rowid)
+{
+	std::lock_guard<std::mutex> lck(pageMutex);
+	if ( hookTable!=table ) return;
+	if ( !changed ) {
+		changedLo = changedHi = rowid;
+		changedMoved = false;
+		changedRows.clear();
+		Fl::awake(delta_ready, this);
+	}
+	changedLo = std::min(changedLo, rowid);
+	changedHi = std::max(changedHi, rowid);
+	if ( type!=SQLITE_UPDATE || changedRows.size()>=DELTA_ROWS )
+		changedMoved = true;
+	else
+		changedRows.push_back(rowid);
+	changed = true;
+}
+void sqlTable::delta_ready(void *data)	//on the main loop
+{
+	((sqlTable *)data)->refresh();
+}
+void sqlTable::refresh_timer(void *data)
+{
+	((sqlTable *)data)->refresh();
+}
+void sqlTable::poll_timer(void *data)
+{
+	((sqlTable *)data)->refresh();
+	Fl::repeat_timeout(REFRESH_POLL, poll_timer, data);
+}
+//only when something changed: rows by this process are told by the hook,
+//commits by others by sql_version(), which drop all pages. No sooner than
+//refreshGap after the last refresh, changes meanwhile go in the next one
+void sqlTable::refresh()
+{
+	pageMutex.lock();
+	int any = changed;
+	pageMutex.unlock();
+	unsigned v = sql_version();
+	if ( !any && v==version ) return;
+	std::chrono::duration<double> since =
+							std::chrono::steady_clock::now()-refreshed;
+	if ( since.count()<refreshGap ) {
+		if ( !Fl::has_timeout(refresh_timer, this) )
+			Fl::add_timeout(refreshGap-since.count(), refresh_timer, this);
+		return;
+	}
+	refreshed = std::chrono::steady_clock::now();
+	if ( v!=version ) {
+		version = v;
+		pages_delta(true);
+		pages_clear();
+		dataChanged = true;
 		redraw();
 	}
-	for ( int C=0; C<MAXCOLS; C++ ) sort[C] = 0;//clear sort arrows 8/22/2019
+	else
+		pages_delta(false);
+}
+void sqlTable::patch_ready(void *data)
+{
+	((sqlTable *)data)->pages_merge();
+}
+//take the rows changed: updated rows are read again by rowid and patched
+//in, rows that moved drop the pages after them and refresh the view. An
+//update can bring an uncached row into a filtered or sorted query, those
+//are read too
+void sqlTable::pages_delta(int full)
+{
+	if ( patching && !full ) return;	//taken when the patch is in
+	pageMutex.lock();
+	int any = changed, moved = changedMoved;
+	long long lo = changedLo, hi = changedHi;
+	std::vector<long long> ids;
+	ids.swap(changedRows);
+	changed = false;
+	pageMutex.unlock();
+	if ( !any ) return;
+	if ( !full && (moved || !keyset || loading) ) {
+		full = true;
+		dataChanged = true;
+		redraw();
+	}
+	if ( full ) {
+		if ( !keyset || query.cols.size()>1 ) {
+			pages_clear();
+			return;
+		}
+		pageGen++;
+		for ( auto it=pages.begin(); it!=pages.end(); ) {
+			const row_store &keys = it->second.keys;
+			long long last = keys.empty() ? 0 : atoll(keys.cell(keys.size()-1,
+												keys.cols(keys.size()-1)-1));
+			if ( keys.empty() || (query.desc[0] ? last<=hi : last>=lo) )
+				it = pages.erase(it);
+			else
+				it++;
+		}
+		return;
+	}
+
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	int enter = query.cols.size()>1 || !query.where.empty();
+	std::string in;
+	Row cached;
+	for ( long long id : ids ) {
+		std::string rowid = std::to_string(id);
+		int pg, r;
+		if ( page_find(rowid.c_str(), pg, r) )
+			cached.push_back(rowid);
+		else if ( !enter )
+			continue;
+		in += (in.empty() ? "" : ",") + rowid;
+	}
+	if ( in.empty() ) return;
+	pageGen++;						//read ahead may predate the change
+	page_job *job = new page_job;
+	job->query = query;
+	job->patch = true;
+	job->key = cached;
+	job->select = query.select + query.table + " where rowid in (" + in + ")";
+	if ( !query.where.empty() ) job->select += " and (" + query.where + ")";
+	job->gen = pageGen;
+	job->page = viewRows;
+	patching = true;
+	std::lock_guard<std::mutex> lck(pageMutex);
+	patchJob = job;
+	pageCv.notify_one();
+}
+//the changed rows are in: patched into their pages and, when shown, into
+//_rowdata, redrawing just those rows. A row that left or joined the query,
+//or moved in its order, refreshes the view
+void sqlTable::patch_merge(page_job *job)
+{
+	patching = false;
+	if ( job->gen!=pageGen ) {		//dropped meanwhile, read again anyway
+		refresh();
+		return;
+	}
+	size_t asked = 0, seen = 0;
+	int pg, r;
+	for ( auto &id : job->key )
+		if ( page_find(id.c_str(), pg, r) ) asked++;
+	int moved = !job->ok;
+	for ( size_t k=0; !moved && k<job->rows.size(); k++ ) {
+		const char *id = job->keys.cell(k, job->keys.cols(k)-1);
+		if ( !page_find(id, pg, r) || !pages[pg].keys.same(r, job->keys, k) ) {
+			moved = true;
+			break;
+		}
+		if ( std::find(job->key.begin(), job->key.end(), id)!=job->key.end() )
+			seen++;
+	}
+	if ( moved || seen<asked ) {
+		pages_clear();
+		dataChanged = true;
+		redraw();
+		return;
+	}
+
+	if ( compiledGen!=styleGen ) style_compile();
+	int first = std::max(0, totalRows-viewRows-topRow);
+	int n = std::min(viewRows, totalRows-first);
+	int shown = topRow==top_row() && (int)_rowdata.size()==n &&
+				(int)_rowstyle.size()==n;
+	for ( size_t k=0; k<job->rows.size(); k++ ) {
+		page_find(job->keys.cell(k, job->keys.cols(k)-1), pg, r);
+		row_page &p = pages[pg];
+		if ( p.rows.same(r, job->rows, k) ) continue;
+		p.rows.replace(r, job->rows, k);
+		if ( p.styled==styleGen ) p.styles[r] = style_of(p.rows, r);
+		if ( p.measured==widthGen ) col_widths(p.rows, r);
+		int q = pg*viewRows+r;
+		if ( !shown || q<first || q>=first+n ) continue;
+		int d = first+n-1-q;		//_rowdata[0] is the last query row
+		Fl::lock();
+		_rowdata.replace(d, p.rows, r);
+		_rowstyle[d] = style_of(p.rows, r);
+		Fl::unlock();
+		redraw_range(topRow+d, topRow+d, 0, cols()-1);
+	}
+	refresh();						//changed while reading
+}
+void sqlTable::pages_clear()
+{
+	pages.clear();
+	pageGen++;
 }
 void sqlTable::draw_sort_arrow(int X,int Y,int W,int H, int C)
 {
@@ -139,7 +1101,6 @@ void sqlTable::draw_sort_arrow(int X,int Y,int W,int H, int C)
 }
 
 // Handle drawing all cells in table
-const Fl_Color cell_color[] = { FL_WHITE, FL_DARK1, fl_lighter(FL_BLUE), FL_YELLOW, FL_RED };
 void sqlTable::draw_cell(TableContext context, int R, int C, int X, int Y, int W, int H)
 {
 	switch ( context ) {
@@ -151,7 +1112,8 @@ void sqlTable::draw_cell(TableContext context, int R, int C, int X, int Y, int W
 				fl_color(FL_BLACK);
 				fl_draw(header[C].c_str(), X+4,Y,W,H,
 						FL_ALIGN_LEFT|FL_ALIGN_BOTTOM, 0, 0);
-				if ( sort[C]!=0 ) draw_sort_arrow(X,Y,W,H,C);
+				if ( C<(int)sort.size() && sort[C]!=0 )
+					draw_sort_arrow(X,Y,W,H,C);
 			}
 			fl_pop_clip();
 			break;
@@ -172,21 +1134,16 @@ void sqlTable::draw_cell(TableContext context, int R, int C, int X, int Y, int W
 		case CONTEXT_CELL: {
 			int r = R-top_row();
 			if ( r >= (int)_rowdata.size() ) break;
-			if ( C >= (int)_rowdata[r].size() ) break;
+			if ( C >= _rowdata.cols(r) ) break;
 			if ( r==edit_row && C==edit_col ) break;
-			int icolor=0;
-			const char *s = _rowdata[r][C].c_str();
-			if ( C==severityCol && clearCol!=-1 ) {
-				if ( _rowdata[r][clearCol]=="" ) {
-					if ( strcmp(s, "critical")==0 ) icolor=4;
-					else if ( strcmp(s, "major")==0 ) icolor=3;
-					else if ( strcmp(s, "minor")==0 ) icolor=2;
-					else if ( strcmp(s, "warning")==0 ) icolor=1;
-				}
-			}
+			const char *s = _rowdata.cell(r, C);
+			Fl_Color bg = FL_WHITE;
+			if ( r<(int)_rowstyle.size() && _rowstyle[r]<styleColors.size() &&
+				 C<(int)styleColors[_rowstyle[r]].size() )
+				bg = styleColors[_rowstyle[r]][C];
 			fl_push_clip(X,Y,W,H);
 			{
-				fl_color(is_selected(R,C) ? FL_CYAN : cell_color[icolor]);
+				fl_color(is_selected(R,C) ? FL_CYAN : bg);
 				fl_rectf(X,Y,W,H);
 				fl_font(ROW_FONTFACE, ROW_FONTSIZE);
 				fl_color(FL_BLACK);
@@ -199,34 +1156,138 @@ void sqlTable::draw_cell(TableContext context, int R, int C, int X, int Y, int W
 		default: break;
 	}
 }
+void sqlTable::load_timer(void *data)	//the query is slow, say so
+{
+	sqlTable *pTable = (sqlTable *)data;
+	pTable->loadShown = true;
+	pTable->redraw();
+}
+void sqlTable::count_timer(void *data)	//until the exact count is in
+{
+	sqlTable *pTable = (sqlTable *)data;
+	pTable->data_changed(true);
+	pTable->redraw();
+}
 void sqlTable::draw()
 {
-	if ( !editing && ( dataChanged || topRow!=top_row()) ) {
-		char sql[1024];
+	pages_merge();
+	int r1, r2, c1, c2;
+	visible_cells(r1, r2, c1, c2);
+	if ( cancelled && topRow==top_row() ) dataChanged = false;
+	if ( !editing && ( dataChanged || topRow!=top_row() ||
+					   c1!=leftCol || c2!=rightCol ) ) {
+		int verify = dataChanged;
+		cancelled = false;
+		leftCol = c1;
+		rightCol = c2;
+		if ( dataChanged ) {		//scrolling alone keeps count and pages
+			if ( keyset ) {			//cached, counted in the background
+				int count = -1;
+				int exact = sql_count(query.table.c_str()+6,
+										query.where.c_str(), &count);
+				if ( !exact && !Fl::has_timeout(count_timer, this) )
+					Fl::add_timeout(count<0 ? 0.1 : 0.5, count_timer, this);
+				if ( count<0 ) count = viewRows;	//read from the end until counted
+				if ( count!=totalRows && !countExact )
+					pages_clear();	//read from the end, placed by a stale count
+				countExact = exact;
+				totalRows = count;
+				rows(totalRows);
+			}
+			pages_delta(true);
+		}
 		dataChanged = false;
 		topRow = top_row();
-		strncpy(sql, count_sql.c_str(), 1023);
-		if ( sql_row(sql) ) {
-			totalRows = atoi(sql);
-			rows(totalRows);
+		int first = totalRows-viewRows-top_row();
+		if ( first<0 ) first = 0;
+		int n = std::min(viewRows, totalRows-first);
+		if ( compiledGen!=styleGen ) style_compile();
+		cols_wanted(needCols, 0);
+		int P = viewRows, lo = first/P, hi = (first+n-1)/P, ready = true;
+		for ( int pg=lo; n>0 && pg<=hi; pg++ )
+			if ( !page_ready(pg) ) ready = false;
+
+		page_job *job = NULL;		//the rows shown stay until it is in
+		if ( keyset && ready ) {	//_rowdata[0] is the last query row
+			for ( int pg=lo; n>0 && pg<=hi; pg++ ) {	//only pages read since
+				row_page &p = pages[pg];
+				if ( p.measured!=widthGen ) {
+					for ( size_t r=0; r<p.rows.size(); r++ )
+						col_widths(p.rows, r);
+					p.measured = widthGen;
+				}
+				if ( p.styled!=styleGen ) {
+					p.styles.clear();
+					for ( size_t r=0; r<p.rows.size(); r++ )
+						p.styles.push_back(style_of(p.rows, r));
+					p.styled = styleGen;
+				}
+			}
+			Fl::lock();
+			_rowdata.clear();
+			_rowstyle.clear();
+			_rowids.clear();
+			_rowpartial = false;
+			for ( int q=first+n-1; q>=first; q-- ) {
+				const row_page &p = pages[q/P];
+				if ( q%P<(int)p.rows.size() ) {
+					_rowdata.add(p.rows, q%P);
+					_rowstyle.push_back(p.styles[q%P]);
+					const row_store &k = p.keys;
+					_rowids.push_back(atoll(k.cell(q%P, k.cols(q%P)-1)));
+				}
+				else {
+					_rowdata.add(NULL, 0);
+					_rowstyle.push_back(0);
+					_rowids.push_back(0);
+				}
+				if ( !p.fetched.empty() ) _rowpartial = true;
+			}
+			Fl::unlock();
+			if ( first!=lastFirst ) scrollDir = first<lastFirst ? -1 : 1;
+			lastFirst = first;
+			if ( !verify ) pages_prefetch(first, n);
+		}
+		if ( keyset && n>0 && (!ready || verify) ) {
+			job = new page_job;
+			page_anchor(*job, lo*P, std::min((hi-lo+1)*P, totalRows-lo*P));
+			project(*job);
+		}
+		else if ( !keyset ) {		//counted with the rows, by the worker
+			job = new page_job;
+			if ( verify ) job->count = count_sql;
+			job->top = top_row();
+			job->first = first;
+			job->limit = viewRows;
+		}
+		if ( job!=NULL ) {
+			job->load = true;
+			job->verify = verify;
+			job->select = select_sql;
+			job->gen = pageGen;
+			job->page = P;
+			load_post(job);
 		}
-		Fl::lock();
-		for ( size_t i=0; i<_rowdata.size(); i++ )
-			_rowdata[i].clear();
-		_rowdata.clear();
-		Fl::unlock();
-		int offset = totalRows-viewRows-top_row();
-		if ( offset<0 ) offset = 0;
-		sprintf(sql, "%s limit %d offset %d", select_sql.c_str(),
-							viewRows, offset);
-		sql_exec(sql, sql_callback, this);
 	}
 	Fl_Table::draw();
+	if ( loadShown || pasteTotal>0 ) {	//over the last good rows
+		char paste[64];
+		sprintf(paste, "pasted %d of %d rows", (int)pasteDone, (int)pasteTotal);
+		const char *msg = pasteTotal>0 ? paste : "loading... Esc to cancel";
+		int W=0, H=0;
+		fl_font(HEADER_FONTFACE, HEADER_FONTSIZE);
+		fl_measure(msg, W, H, 0);
+		W += 16; H += 8;
+		fl_draw_box(FL_BORDER_BOX, x()+w()-W-24, y()+28, W, H, FL_YELLOW);
+		fl_color(FL_BLACK);
+		fl_draw(msg, x()+w()-W-24, y()+28, W, H, FL_ALIGN_CENTER, 0, 0);
+	}
 }
 void sqlTable::resize (int X, int Y, int W, int H)
 {
 	viewRows = H/24-2;
 	dataChanged = true;
+	pages_clear();					//pages are viewRows long
 	Fl_Table::resize(X, Y, W, (viewRows+2)*24);
 }
 int sqlTable::handle( int e )
@@ -266,7 +1327,7 @@ int sqlTable::handle( int e )
 				done_edit();
 				if ( edit_sql[0]=='i' ) {
 					for ( int i=0; i<cols(); i++ )
-						edit_sql = edit_sql + _rowdata[edit_row][i] + "\",\"";
+						edit_sql = edit_sql + _rowdata.cell(edit_row, i) + "\",\"";
 					edit_sql = edit_sql.replace(edit_sql.size()-3,3,"\")");
 				}
 				else {
@@ -309,7 +1370,7 @@ void sqlTable::start_edit(int R, int C)
 	int X,Y,W,H;
 	find_cell( CONTEXT_CELL, R+top_row(), C, X,Y,W,H );
 	edit_input->resize(X,Y,W,H);
-	edit_input->value(_rowdata[edit_row][edit_col].c_str());
+	edit_input->value(_rowdata.cell(edit_row, edit_col));
 	edit_input->show();
 	edit_input->take_focus();
 	edit_input->clear_changed();
@@ -318,19 +1379,42 @@ void sqlTable::start_edit(int R, int C)
 void sqlTable::done_edit()
 {
 	if ( edit_input->changed() ) {
-		_rowdata[edit_row][edit_col]=edit_input->value();
+		_rowdata.set(edit_row, edit_col, edit_input->value());
 		if ( edit_sql[0]=='u' ) {
 			edit_sql = edit_sql + header[edit_col] + "=\"";
 			edit_sql = edit_sql + edit_input->value() + "\",";
 		}
 	}
 }
+//the rows shown have only the columns around the view, read all of them
+//before rows are edited
+void sqlTable::rows_full()
+{
+	if ( !_rowpartial ) return;
+	std::string in;
+	for ( long long id : _rowids )
+		if ( id!=0 ) in += (in.empty() ? "" : ",") + std::to_string(id);
+	if ( in.empty() ) return;
+	page_job job;
+	job.query = query;
+	std::string sql = query.select+query.table+" where rowid in ("+in+")";
+	if ( !sql_select(sql.c_str(), page_callback, &job) ) return;
+	Fl::lock();
+	for ( size_t k=0; k<job.rows.size(); k++ ) {
+		long long id = atoll(job.keys.cell(k, job.keys.cols(k)-1));
+		for ( size_t d=0; d<_rowids.size(); d++ )
+			if ( _rowids[d]==id ) _rowdata.replace(d, job.rows, k);
+	}
+	Fl::unlock();
+	_rowpartial = false;
+}
 void sqlTable::insert_row()
 {
 	int row_top, col_left, row_bot, col_right;
 	get_selection(row_top, col_left, row_bot, col_right);
 	if ( row_top==-1 || col_left==-1 ) return;
 
+	rows_full();
 	start_edit( row_top-top_row(), 0 );
 	edit_sql = "insert into ";
 	edit_sql = edit_sql + label() + " ('";
@@ -345,35 +1429,111 @@ void sqlTable::update_row()
 	if ( row_top==-1 || col_left==-1 ) return;
 
 	int r = row_top-top_row();
+	rows_full();
 	start_edit( r, col_left );
 	edit_sql = "update ";
 	edit_sql = edit_sql + label() + " set ";
 	where_clause = " where ";
 	for ( int i=0; i<cols(); i++ )
-		where_clause = where_clause + header[i]+"='"+_rowdata[r][i]+"' and ";
+		where_clause = where_clause + header[i]+"='"+_rowdata.cell(r, i)+"' and ";
 	where_clause = where_clause.replace(where_clause.size()-5,5,"");
 }
+//paged by seeking, the rowids shown are deleted as they are. A selection
+//running off the view is read by the query from the sort key of an edge
+//row as it was shown, the first, else the last, and no further than the
+//other edge or the number of rows selected, so rows the count or an
+//ingest moved are not taken by position. Either way the rows go in one
+//batch, a transaction of their own, all of them or none
 void sqlTable::delete_rows()
 {
 	int row_top, col_left, row_bot, col_right;
 	get_selection(row_top, col_left, row_bot, col_right);
 	if ( row_top==-1 || col_left==-1 ) return;
-	if ( row_top<topRow || row_bot-row_top>_rowdata.size() ) {
+	if ( keyset ) {
+		int id = sql_ingest_prepare(("delete from " + query.table.substr(6) +
+										" where rowid=?").c_str());
+		if ( id<0 ) {
+			fl_alert("%s", sql_errmsg());
+			return;
+		}
+		std::vector<long long> ids;
+		if ( row_top>=topRow && row_bot-topRow<(int)_rowids.size() ) {
+			for ( int r=row_top; r<=row_bot; r++ )
+				if ( _rowids[r-topRow]!=0 ) ids.push_back(_rowids[r-topRow]);
+		}
+		else {
+			int P = viewRows;
+			Row edge[2];			//keys of the first and last row selected
+			int q[2] = { totalRows-1-row_bot, totalRows-1-row_top };
+			for ( int e=0; e<2; e++ ) {
+				std::map<int, row_page>::iterator it = pages.find(q[e]/P);
+				if ( q[e]>=0 && it!=pages.end() &&
+					 q[e]%P<(int)it->second.keys.size() )
+					edge[e] = it->second.keys.row(q[e]%P);
+			}
+			if ( edge[0].empty() && edge[1].empty() ) {
+				fl_alert("scroll to the first or last row selected");
+				return;
+			}
+			page_job job;
+			job.query = query;
+			job.query.select = "select rowid" + query.keys;
+			job.reverse = edge[0].empty();
+			job.key = job.reverse ? edge[1] : edge[0];
+			ids.push_back(atoll(job.key.back().c_str()));
+			long long last = job.reverse || edge[1].empty() ? 0 :
+											atoll(edge[1].back().c_str());
+			std::string sql = job.query.sql(&job.key, job.reverse,
+											row_bot-row_top, 0);
+			if ( !page_select(sql, job) ) {
+				fl_alert("%s", sql_errmsg());
+				return;
+			}
+			for ( size_t r=0; r<job.rows.size() && ids.back()!=last; r++ )
+				ids.push_back(atoll(job.rows.cell(r, 0)));
+		}
+		void *batch = sql_batch();
+		for ( long long rowid : ids )
+			sql_batch_ingest(batch, id, "l", rowid);
+		if ( !sql_batch_commit(batch) ) fl_alert("%s", sql_errmsg());
+		redraw();
+		return;
+	}
+	int loaded = row_top>=topRow && row_bot-topRow<(int)_rowdata.size();
+	for ( int r=row_top; loaded && r<=row_bot; r++ )
+		loaded = _rowdata.cols(r-topRow)>col_right;
+	if ( !loaded ) {					//rows are matched by the cells shown
 		fl_alert("delete displayed rows only");
 		return;
 	}
 
+	edit_sql = "delete from ";
+	edit_sql = edit_sql + label() + " where ";
+	for ( int i=col_left; i<=col_right; i++ )
+		edit_sql = edit_sql + header[i]+"=? and ";
+	edit_sql = edit_sql.replace(edit_sql.size()-5,5,"");
+	int id = sql_ingest_prepare(edit_sql.c_str());
+	if ( id<0 ) {
+		fl_alert("%s", sql_errmsg());
+		return;
+	}
+	int n = col_right-col_left+1;
+	std::vector<const char *> cells(n);
+	std::vector<int> lens(n);
+	void *batch = sql_batch();
 	for ( int r=row_top-topRow; r<=row_bot-topRow; r++ ) {
-		edit_sql = "delete from ";
-		edit_sql = edit_sql + label() + " where ";
-		for ( int i=col_left; i<=col_right; i++ )
-			edit_sql = edit_sql + header[i]+"='"+_rowdata[r][i]+"' and ";
-		edit_sql = edit_sql.replace(edit_sql.size()-5,5,"");
-		sql_exec(edit_sql.c_str(), NULL, NULL);
+		for ( int i=0; i<n; i++ ) {
+			cells[i] = _rowdata.cell(r, col_left+i);
+			lens[i] = strlen(cells[i]);
+		}
+		sql_batch_cells(batch, id, n, cells.data(), lens.data());
 	}
+	if ( !sql_batch_commit(batch) ) fl_alert("%s", sql_errmsg());
 	redraw();
 }
-int sqlTable::get_rows(char **pBuf)
+//streams the selected cells to the sink as sql_stream does, tab separated
+//with the column names first, returns the rows or -1
+int sqlTable::get_rows(int (*sink)(void *, const char *, int), void *data)
 {
 	int row_top, col_left, row_bot, col_right;
 	get_selection(row_top, col_left, row_bot, col_right);
@@ -385,53 +1545,163 @@ int sqlTable::get_rows(char **pBuf)
 	for ( int C=col_left; C<col_right; C++ ) copy_sql += header[C] + ",";
 	copy_sql += header[col_right] + select_sql.substr(from) + " limit " + limit;
 
-	return sql_table(copy_sql.c_str(), pBuf);
+	return sql_stream(copy_sql.c_str(), sink, data);
+}
+//the clipboard takes the text whole, it is gathered here chunk by chunk
+//and the copy is given up past CLIP_MAX bytes
+#define CLIP_MAX	(256<<20)
+struct clip_buf {
+	std::string text;
+	int full = false;
+};
+static int clip_sink(void *data, const char *p, int n)
+{
+	clip_buf *clip = (clip_buf *)data;
+	if ( clip->text.size()+n>CLIP_MAX ) {
+		clip->full = true;
+		return -1;
+	}
+	clip->text.append(p, n);
+	return n;
 }
 void sqlTable::copy_rows()
 {
-	char *buf;
-	int len = get_rows(&buf);
-	Fl::copy(buf, len, 1);
-	free(buf);
+	clip_buf clip;
+	if ( get_rows(clip_sink, &clip)<0 ) {
+		if ( clip.full )
+			fl_alert("the selection is over %d MB, too large to copy",
+						CLIP_MAX>>20);
+		else
+			fl_alert("%s", sql_errmsg());
+		return;
+	}
+	Fl::copy(clip.text.data(), clip.text.size(), 1);
 }
+//the first line names the columns, the rest are rows of tab separated cells.
+//Cells are bound from the clipboard text as they are, on a thread of its
+//own in batches of PASTE_ROWS rows, with the rows done so far shown over the
+//table. A row with more cells than there are names stops the paste before
+//anything is written, a batch that fails is rolled back and it stops there
 void sqlTable::paste_rows()
 {
-	char txt[1024];
-	const char *p1 = strchr(Fl::event_text(), 0x0a);
-	if ( p1==NULL ) return;
-	const char *p0 = Fl::event_text();
-	int l = p1-p0;
-	strncpy( txt, p0, l); txt[l]=0;
-	for ( char *p2=txt; *p2; p2++ ) if ( *p2=='\t' ) *p2=',';
-	edit_sql = "insert or replace into ";
-	edit_sql = edit_sql + label() + " (";
-	edit_sql = edit_sql + txt + ") values (\"";
-	int header_len = edit_sql.size();
+	if ( pasteState!=0 ) {
+		fl_alert("a paste is still running");
+		return;
+	}
+	const char *p = Fl::event_text();
+	if ( p==NULL || memchr(p, '\n', Fl::event_length())==NULL ) return;
+	pasteText.assign(p, Fl::event_length());
+	pasteTable = label();
+	pasteError.clear();
+	pasteDone = pasteTotal = 0;
+	pasteState = 1;
+	paster = std::thread(paste_work, this);
+	Fl::add_timeout(0.2, paste_timer, this);
+}
+void sqlTable::paste_timer(void *data)	//the rows done, until it is over
+{
+	sqlTable *pTable = (sqlTable *)data;
+	pTable->redraw();
+	if ( pTable->pasteState==1 ) {
+		Fl::repeat_timeout(0.2, paste_timer, data);
+		return;
+	}
+	pTable->paster.join();
+	pTable->pasteTotal = 0;
+	pTable->pasteState = 0;
+	if ( !pTable->pasteError.empty() )
+		fl_alert("%s", pTable->pasteError.c_str());
+}
+void sqlTable::paste_work(sqlTable *t)
+{
+	const char *p = t->pasteText.data();
+	const char *end = p+t->pasteText.size();
+	const char *eol = (const char *)memchr(p, '\n', end-p);
+	std::string names, marks;
+	int n = 0;
+	for ( const char *q=p; q<=eol; n++ ) {
+		const char *tab = (const char *)memchr(q, '\t', eol-q);
+		const char *e = tab!=NULL ? tab : eol;
+		if ( e>q && e[-1]=='\r' ) e--;
+		names += names.empty() ? "\"" : ",\"";
+		for ( ; q<e; q++ ) names += *q=='"' ? "\"\"" : std::string(1, *q);
+		names += "\"";
+		marks += marks.empty() ? "?" : ",?";
+		q = (tab!=NULL ? tab : eol)+1;
+	}
 
-	while ( p1!=NULL ) {
-		p0 += l+1;
-		p1 = strchr(p0, 0x0a);
-		if ( p1!=NULL )
-			l = p1-p0;
-		else
-			l = strlen(p0);
-		strncpy(txt, p0, l); txt[l]=0;
-		edit_sql = edit_sql + txt + "\")";
-		int i = edit_sql.find("\t");
-		while ( i!=-1 ){
-			edit_sql.replace(i,1,"\",\"");
-			i = edit_sql.find("\t");
+	int total = 0, line = 1;
+	char msg[256];
+	for ( const char *q=eol+1; q<end && t->pasteError.empty(); line++ ) {
+		const char *e = (const char *)memchr(q, '\n', end-q);
+		const char *next = e!=NULL ? e+1 : end;	//the last may have no newline
+		if ( e==NULL ) e = end;
+		if ( e>q && e[-1]=='\r' ) e--;
+		if ( e>q ) {						//blank lines are skipped
+			int cells = 1+std::count(q, e, '\t');
+			if ( cells>n ) {
+				snprintf(msg, sizeof(msg), "line %d has %d cells, the first "
+						"line names %d columns, nothing pasted", line+1, cells, n);
+				t->pasteError = msg;
+			}
+			total++;
 		}
-		sql_exec(edit_sql.c_str(), NULL, NULL);
-		edit_sql.erase( header_len );
+		q = next;
 	}
-	redraw();
+	t->pasteTotal = total;
+
+	std::string table = "\"";
+	for ( const char *c=t->pasteTable.c_str(); *c; c++ )
+		table += *c=='"' ? "\"\"" : std::string(1, *c);
+	std::string sql = "insert or replace into " + table + "\" (" + names +
+						") values (" + marks + ")";
+	int id = t->pasteError.empty() ? sql_ingest_prepare(sql.c_str()) : 0;
+	if ( id<0 ) t->pasteError = sql_errmsg();
+	if ( !t->pasteError.empty() ) {
+		t->pasteState = 2;
+		return;
+	}
+
+	std::vector<const char *> cells(n);
+	std::vector<int> lens(n);
+	void *batch = sql_batch();
+	int ok = true, done = 0;
+	for ( p=eol+1; ok && p<end; p=eol+1 ) {
+		eol = (const char *)memchr(p, '\n', end-p);
+		if ( eol==NULL ) eol = end;
+		const char *e = eol;
+		if ( e>p && e[-1]=='\r' ) e--;
+		if ( e==p ) continue;				//blank line
+		int c = 0;
+		for ( const char *q=p; c<n; ) {	//missing cells are empty
+			const char *tab = q<e ? (const char *)memchr(q, '\t', e-q) : NULL;
+			cells[c] = q;
+			lens[c++] = (tab!=NULL ? tab : e)-q;
+			q = tab!=NULL ? tab+1 : e;
+		}
+		sql_batch_cells(batch, id, n, cells.data(), lens.data());
+		if ( ++done%PASTE_ROWS==0 ) {
+			ok = sql_batch_commit(batch);
+			if ( ok ) t->pasteDone = done;
+			batch = sql_batch();
+		}
+	}
+	if ( !sql_batch_commit(batch) ) ok = false;
+	else if ( ok ) t->pasteDone = done;
+	if ( !ok ) {
+		snprintf(msg, sizeof(msg), "paste stopped after %d rows, ",
+					(int)t->pasteDone);
+		t->pasteError = msg + std::string(sql_errmsg());
+	}
+	std::string().swap(t->pasteText);
+	t->pasteState = 2;
 }
 void sqlTable::col_dclick(int COL)	//dclick on col header to change sorting
 {
+	if ( COL>=(int)sort.size() ) sort.resize(COL+1, 0);
 	if ( sort[COL]==0 ) {			//no sort, change to ASC
 		int sort_order=1;
-		for ( int i=0; i<MAXCOLS; i++ ) {
+		for ( int i=0; i<(int)sort.size(); i++ ) {
 			if ( sort[i]==sort_order ) sort_order = 1+sort[i];
 			if ( sort[i]==-sort_order ) sort_order = 1-sort[i];
 		}
@@ -442,7 +1712,7 @@ void sqlTable::col_dclick(int COL)	//dclick on col header to change sorting
 	}
 	else if ( sort[COL]<0 ) {		//DESC sort, change to no sort
 		int sort_order=-sort[COL];
-		for ( int i=0; i<MAXCOLS; i++ ) {
+		for ( int i=0; i<(int)sort.size(); i++ ) {
 			if ( sort[i]>sort_order ) sort[i]-=1;
 			if ( sort[i]<-sort_order ) sort[i]+=1;
 		}
@@ -452,8 +1722,8 @@ void sqlTable::col_dclick(int COL)	//dclick on col header to change sorting
 	std::size_t i = select_sql.find(" order by");
 	if ( i==std::string::npos ) i = select_sql.find(" limit");
 	if ( i!=std::string::npos ) select_sql.erase(i);
-	for ( int k=1; k<7; k++ ) {
-		for ( int j=0; j<MAXCOLS; j++ ) {
+	for ( int k=1; k<=(int)sort.size(); k++ ) {
+		for ( int j=0; j<(int)sort.size(); j++ ) {
 			if ( sort[j]==k || sort[j]==-k ) {
 				select_sql = select_sql + ((k==1)?" order by ":", ");
 				select_sql = select_sql + header[j];
@@ -463,6 +1733,7 @@ void sqlTable::col_dclick(int COL)	//dclick on col header to change sorting
 	}
 	i = select_sql.find("from ");
 	count_sql="select COUNT(rowid) "+select_sql.substr(i);
+	keyset_parse();
 	dataChanged=true;
 	redraw();
 }
@@ -477,7 +1748,7 @@ void sqlTable::cell_dclick(int R, int C)	//double click on cell to filter
 	}
 	int r = R-top_row();
 	std::string filter = " ";
-	filter = filter + header[C] + "='" + _rowdata[r][C] + "'";
+	filter = filter + header[C] + "='" + _rowdata.cell(r, C) + "'";
 	int i2 = select_sql.find(filter + " and");
 	int i1 = select_sql.find(" and" + filter);
 	int i0 = select_sql.find(" where" + filter);
@@ -493,6 +1764,7 @@ void sqlTable::cell_dclick(int R, int C)	//double click on cell to filter
 	select_sql += order_by;
 	i = select_sql.find("from ");
 	count_sql="select COUNT(rowid) "+select_sql.substr(i);
+	keyset_parse();
 	dataChanged=true;
 	redraw();
 }
@@ -514,17 +1786,8 @@ void sqlTable::cell_rclick(int R, int C)	//cell right click menu
 		}
 	}
 }
-void sqlTable::save( const char *fn )
+//every row of the query, not just those shown, written in the background
+int sqlTable::save( const char *fn )
 {
-	FILE *fp = fopen( fn, "w+" );
-	if ( fp!=NULL  ){
-		for ( int i=0; i<(int)_rowdata[0].size()-1; i++ )
-			fprintf( fp, "%s, ", header[i].c_str() );
-		for ( int i=0; i<(int)_rowdata.size(); i++ ) {
-			fprintf( fp, "\n" );
-			for ( int j=0; j<(int)_rowdata[i].size()-1; j++ )
-				fprintf( fp, "%s, ", _rowdata[i][j].c_str() );
-		}
-		fclose(fp);
-	}
+	return sql_export(select_sql.c_str(), fn);
 }
@@ -20,29 +20,162 @@
 #include <FL/Fl_Table.H>
 #include <vector>
 #include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #ifndef __SQL_TABLE_H__
 #define __SQL_TABLE_H__
 
-#define MAXCOLS 		16
 #define ROW_FONTSIZE	14
 #define HEADER_FONTSIZE 16
 #define ROW_FONTFACE	FL_HELVETICA
 #define HEADER_FONTFACE FL_HELVETICA_BOLD
 //#define LABEL_FONTFACE	FL_COURIER_BOLD
+#define PREFETCH_PAGES	8		//pages of viewRows cached each side of the view
+#define TEXT_WIDTHS		8192	//cell widths memoized, dropped all at once when full
+#define STYLE_RULES		64		//rules per table, the matches of a row are a bit mask
+#define LOAD_DELAY		0.3		//seconds before a running query shows "loading"
+#define COL_MARGIN		8		//columns read each side of those shown
+#define DELTA_ROWS		64		//rows updated before a change refreshes the view
+#define REFRESH_POLL	0.5		//seconds between looks at sql_version()
+#define REFRESH_MIN		0.1		//seconds between refreshes, at least
+#define REFRESH_MAX		2.0		//and at most, under heavy ingest
+#define REFRESH_LOAD	4		//times the last refresh took, between them
+#define PASTE_ROWS		50000	//rows pasted per batch, each its own transaction
 typedef std::vector<std::string> Row;
+class row_store {				//rows of cells in one buffer, kept when cleared
+public:
+	void clear() { text.clear(); cells.clear(); spans.clear(); }
+	size_t size() const { return spans.size(); }
+	int empty() const { return spans.empty(); }
+	int cols(size_t r) const { return spans[r].n; }
+	const char *cell(size_t r, int c) const
+		{ return text.data()+cells[spans[r].cell+c]; }
+	void add(const char *const *argv, int n);	//NULL cells as ""
+	void add(const row_store &from, size_t r);
+	void set(size_t r, int c, const char *s);
+	void replace(size_t r, const row_store &from, size_t k);
+	int same(size_t r, const row_store &o, size_t k) const;
+	Row row(size_t r) const;
+	void reverse() { std::reverse(spans.begin(), spans.end()); }
+private:
+	struct span { unsigned cell, n; };
+	std::string text;			//cells, each 0 terminated
+	std::vector<unsigned> cells;	//offset of each cell in text
+	std::vector<span> spans;	//first cell and number of cells of each row
+};
+struct key_query {				//select_sql split for paging by seeking
+	std::string select, table, where;
+	std::vector<std::string> cols;	//sort key, rowid last
+	std::vector<int> desc;
+	std::vector<std::string> fields;	//the columns selected, by header position
+	std::string keys;			//quoted sort key and rowid, after the columns
+	int star;					//fields are the header's names
+	void star_names(const Row &names);
+	static std::string key_expr(const std::string &col);
+	std::string sql(const Row *key, int reverse, int limit, int offset) const;
+};
+struct style_cond {				//<col> <op> <value>, numbers compare as numbers
+	std::string col, text;
+	int index, op;				//op is one of = ! < > l(<=) g(>=)
+	int numeric;
+	double num;
+};
+struct style_rule {				//colours the target cell, or the row for "*"
+	std::string target;
+	int index, active;			//positions in the header, when all are there
+	Fl_Color color;
+	std::vector<style_cond> conds;	//all must hold
+};
+struct row_page {				//viewRows rows of the query, in query order
+	row_store rows;
+	row_store keys;				//quoted sort key of each row, rowid last
+	unsigned used;
+	int measured;				//widthGen when its widths were taken
+	std::vector<unsigned char> styles;	//style of each row
+	int styled;					//styleGen when styled
+	std::vector<char> fetched;	//columns read, by header position, empty for all
+};
+struct page_job {				//rows from first, read by seeking from key
+	key_query query;
+	Row key;					//empty to read from either end
+	int reverse, limit, offset;
+	int gen, first, ok;
+	int page;					//viewRows when queued
+	int load = false, verify = false;	//the view itself, not read ahead
+	int patch = false;			//rows changed, select reads them by rowid
+	double took = 0;			//seconds on the worker
+	std::string select, count;	//paged by offset, counted when not empty
+	int top = 0, total = -1;
+	std::atomic<int> cancelled{false};
+	std::vector<int> cols;		//header positions selected, empty for all
+	int width = 0;				//of the header, rows have a cell for each
+	std::vector<const char *> argv;
+	row_store rows, keys;
+	Row names;
+	int same(const page_job &o) const
+		{ return load && o.load && select==o.select && count==o.count &&
+				 first==o.first && limit==o.limit && top==o.top &&
+				 cols==o.cols; }
+};
 class sqlTable : public Fl_Table {
 private:
-    int severityCol;
-    int clearCol;
 	int topRow;				//the top row currently displayed
     int viewRows;			//number of rows loaded and displayed
     int totalRows;			//number of rows are in the current query
     int dataChanged;		//true if loaded data need be refreshed
     int headerChanged;		//true if new select command is used
-	int sort[MAXCOLS];
+	std::vector<int> sort;	//by column, order by position, <0 for DESC
 	Row header;
-	std::vector<Row> _rowdata;
+	std::unordered_map<std::string, int> textWidths;	//by the text itself
+	std::string widthKey;	//text_width() lookups, reuses its buffer
+	int widthGen;			//bumped when the header resets the widths
+	std::vector<style_rule> rules;	//later rules win
+	int styleGen, compiledGen;		//bumped by new rules and headers
+	std::unordered_map<unsigned long long, unsigned char> styleIds;	//by mask
+	std::vector<std::vector<Fl_Color> > styleColors;	//by style, per column
+	std::vector<unsigned char> _rowstyle;	//style of each row shown
+	row_store _rowdata;		//the rows shown, _rowdata[0] is the last query row
+	std::vector<long long> _rowids;	//of the rows shown, when paged by seeking
+	int _rowpartial;		//only the columns around the view were read
+	int leftCol, rightCol;	//the columns shown
+	std::vector<int> needCols;	//columns the pages shown must have
+
+	int keyset;				//true if select_sql can be paged by seeking
+	int countExact;			//totalRows placed the pages read from the end
+	key_query query;
+	std::map<int, row_page> pages;	//by query position/viewRows
+	unsigned pageClock;
+	int pageGen;			//bumped whenever cached pages are dropped
+	int lastFirst, scrollDir;
+	int loading, loadShown;	//a view load is queued or running
+	int cancelled;			//by Escape, until the next scroll or select
+	std::thread worker;		//runs the table's queries, off the UI thread
+	void *reader;			//the worker's connection, to interrupt it
+	std::mutex pageMutex;	//guards the members below
+	std::condition_variable pageCv;
+	page_job *loadJob, *prefetchJob, *patchJob, *running;
+	int stopping;
+	std::vector<page_job *> done;
+	std::string hookTable;	//label(), for the writer thread
+	int changed;			//rows changed since last taken
+	int changedMoved;		//by inserts, deletes or too many updates
+	long long changedLo, changedHi;
+	std::vector<long long> changedRows;	//updated, up to DELTA_ROWS
+	int patching;			//a patch is queued or running
+	unsigned version;		//sql_version() when last refreshed
+	double refreshGap;		//seconds, from how long the last refresh took
+	std::chrono::steady_clock::time_point refreshed;
+	std::atomic<int> pasteDone, pasteTotal;	//rows of the paste running, shown
+	std::atomic<int> pasteState;	//1 running, 2 done, until paste_timer joins it
+	std::thread paster;
+	std::string pasteText, pasteTable, pasteError;
 
 	std::string select_sql;
 	std::string count_sql;
@@ -62,24 +195,57 @@ protected:
 	void cell_rclick(int R, int C);
 	void start_edit(int R, int C);
 	void done_edit();
+	void keyset_parse();
+	int text_width(const char *s);
+	void col_widths(const row_store &rows, size_t r);
+	void style_compile();
+	unsigned char style_of(const row_store &rows, size_t r);
+	static void count_timer(void *data);
+	static void load_timer(void *data);
+	static void delta_ready(void *data);
+	static void refresh_timer(void *data);
+	static void poll_timer(void *data);
+	static void paste_timer(void *data);
+	static void paste_work(sqlTable *t);
+	void refresh();
+	static void patch_ready(void *data);
+	static void work(sqlTable *t);
+	void page_anchor(page_job &job, int first, int n);
+	void cols_wanted(std::vector<int> &want, int margin);
+	void project(page_job &job);
+	void rows_full();
+	int page_ready(int page);
+	int page_find(const char *rowid, int &page, int &r);
+	row_page &page_add(int page);
+	void pages_add(page_job *job);
+	void load_post(page_job *job);
+	void load_merge(page_job *job);
+	void patch_merge(page_job *job);
+	void pages_merge();
+	void pages_prefetch(int first, int n);
+	void pages_delta(int full);
+	void pages_clear();
 
 public:
     sqlTable(int x, int y, int w, int h, const char *l=0);
-	~sqlTable(){};
+	~sqlTable();
 	int handle( int e );
 	void draw();
     void resize (int X, int Y, int W, int H);
 
-    void save(const char *fn);
+    int save(const char *fn);
     void insert_row();
     void update_row();
     void delete_rows();
     void copy_rows();
 	void paste_rows();
-	int  get_rows(char **pBuf);
+	int  get_rows(int (*sink)(void *, const char *, int), void *data);
 
-    void insert(int argc, char **argv, char **col_names);
     void data_changed(int t) { dataChanged=t; }
+	void row_changed(int type, const char *table, long long rowid);
+	int load_busy() { return loading; }
+	void load_cancel();
+	int style(const char *spec);
 	int data_changed() { return dataChanged; }
     void select(const char *cmd);
 	const char *select() { return select_sql.c_str(); }